@@ -0,0 +1,779 @@
+/**
+ * @file bench.c
+ * @brief Benchmarks of tinyalloc against the system malloc
+ *
+ * Build from the repository root (POSIX only):
+ *     cc -O2 -I. bench/bench.c tinyalloc.c -lpthread -o tinybench
+ *
+ * Usage:
+ *     tinybench [-w uniform|powerlaw|realloc|prodcons|all] [-t trace] [-a tinyalloc|system|both]
+ *               [-n ops] [-s seed] [-m arena_mb] [-p goodfit|tlsf|best|first|next]
+ *
+ * Every workload is run twice per allocator: once without timing for the throughput and
+ * once timing every call for the latency percentiles. Peak footprint and fragmentation
+ * are sampled every BENCH_SAMPLE_EVERY operations (arena_info for tinyalloc, mallinfo2
+ * for glibc, not available elsewhere).
+ *
+ * Traces are the binary files written by arena_trace_start (TINYALLOC_TRACE), or text files
+ * with one call per line, pointers in hex and sizes in decimal:
+ *     m <ptr> <size>          malloc
+ *     f <ptr>                 free
+ *     r <old> <new> <size>    realloc (old 0 is a malloc)
+ * Other lines are ignored. The pointers only pair the calls, the replay uses its own.
+ */
+
+// clock_gettime
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include "tinyalloc.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define BENCH_HAS_MALLINFO 1
+#else
+#define BENCH_HAS_MALLINFO 0
+#endif
+
+#define BENCH_SAMPLE_EVERY  256
+#define BENCH_SLOTS         4096
+#define BENCH_REALLOC_SLOTS 256
+#define BENCH_REALLOC_LIMIT (64 * 1024)
+#define BENCH_RING_SIZE     1024
+
+// Script of calls, replayed the same way on every allocator
+
+typedef enum {
+    BENCH_MALLOC,
+    BENCH_FREE,
+    BENCH_REALLOC
+} bench_kind_t;
+
+typedef struct {
+    uint32_t kind;
+    uint32_t slot;      // Index of the live pointer used by the call
+    size_t   size;
+} bench_op_t;
+
+typedef struct {
+    bench_op_t* ops;
+    size_t      count;
+    size_t      capacity;
+    size_t      slots;
+} bench_script_t;
+
+// Allocators
+
+typedef struct {
+    const char* name;
+    bool  (*init)(bool threaded);
+    void  (*destroy)(void);
+    void* (*malloc)(size_t size);
+    void* (*realloc)(void* ptr, size_t size);
+    void  (*free)(void* ptr);
+    bool  (*info)(size_t* footprint, size_t* fragmentation);
+    void  (*owner)(void);       // The calling thread becomes the one allocating
+} bench_allocator_t;
+
+static size_t         arena_mb = 256;
+static arena_policy_t policy   = ARENA_POLICY_GOOD_FIT;
+static arena_t        arena;
+static void*          arena_memory;
+
+static bool tiny_init(bool threaded){
+    arena_memory = malloc(arena_mb * 1024 * 1024);
+    if(!arena_memory) return false;
+
+    arena.start_addr = arena_memory;
+    arena.arena_size = arena_mb * 1024 * 1024;
+
+    arena_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.policy = policy;
+    config.slab   = true;
+
+    if(threaded){
+        config.lock        = ARENA_LOCK_MUTEX;
+        config.remote_free = true;
+    }
+
+    arena_init_ex(&arena, &config);
+    return true;
+}
+
+static void tiny_destroy(void){
+    arena_destroy(&arena);
+    free(arena_memory);
+}
+
+static void* tiny_malloc(size_t size){
+    return a_malloc(&arena, size);
+}
+
+static void* tiny_realloc(void* ptr, size_t size){
+    return a_realloc(&arena, ptr, size);
+}
+
+static void tiny_free(void* ptr){
+    a_free(&arena, ptr);
+}
+
+static bool tiny_info(size_t* footprint, size_t* fragmentation){
+    arena_info_t info;
+    arena_info(&arena, &info);
+
+    *footprint     = info.used_size;
+    *fragmentation = info.fragmentation_bytes;
+    return true;
+}
+
+static void tiny_owner(void){
+    arena_set_owner(&arena);
+}
+
+static bool system_init(bool threaded){
+    (void) threaded;
+    return true;
+}
+
+static void system_destroy(void){
+}
+
+static void* system_malloc(size_t size){
+    return malloc(size);
+}
+
+static void* system_realloc(void* ptr, size_t size){
+    return realloc(ptr, size);
+}
+
+static void system_free(void* ptr){
+    free(ptr);
+}
+
+static bool system_info(size_t* footprint, size_t* fragmentation){
+#if BENCH_HAS_MALLINFO
+    // The numbers of the whole process, the script and the latencies are included
+    struct mallinfo2 info = mallinfo2();
+
+    *footprint     = info.arena + info.hblkhd;
+    *fragmentation = info.fordblks;
+    return true;
+#else
+    (void) footprint;
+    (void) fragmentation;
+    return false;
+#endif
+}
+
+static void system_owner(void){
+}
+
+static const bench_allocator_t allocators[] = {
+    { "tinyalloc", tiny_init,   tiny_destroy,   tiny_malloc,   tiny_realloc,   tiny_free,   tiny_info,   tiny_owner   },
+    { "system",    system_init, system_destroy, system_malloc, system_realloc, system_free, system_info, system_owner },
+};
+
+#define BENCH_ALLOCATOR_COUNT (sizeof(allocators) / sizeof(allocators[0]))
+
+// Helpers
+
+static uint64_t now_ns(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+static uint64_t rng_state = 88172645463325252ull;
+
+static uint64_t rng_next(void){
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static size_t rng_range(size_t min, size_t max){
+    return min + (size_t) (rng_next() % (max - min + 1));
+}
+
+static size_t rng_powerlaw(void){
+    // P(size in [2^k, 2^(k+1))) halves with every k from 16 bytes to 64 KiB
+    int k = 4 + __builtin_ctzll(rng_next() | (1ull << 12));
+    return ((size_t) 1 << k) + (size_t) (rng_next() % ((size_t) 1 << k));
+}
+
+static void touch(void* ptr, size_t size){
+    // Write the first and last bytes like a real user of the block
+    if(!ptr || !size) return;
+
+    ((volatile unsigned char*) ptr)[0]        = 1;
+    ((volatile unsigned char*) ptr)[size - 1] = 1;
+}
+
+static bool script_push(bench_script_t* script, uint32_t kind, uint32_t slot, size_t size){
+    if(script->count == script->capacity){
+        size_t      capacity = script->capacity ? script->capacity * 2 : 4096;
+        bench_op_t* ops      = (bench_op_t*) realloc(script->ops, capacity * sizeof(bench_op_t));
+        if(!ops) return false;
+
+        script->ops      = ops;
+        script->capacity = capacity;
+    }
+
+    script->ops[script->count].kind = kind;
+    script->ops[script->count].slot = slot;
+    script->ops[script->count].size = size;
+    script->count++;
+
+    if(slot >= script->slots) script->slots = (size_t) slot + 1;
+    return true;
+}
+
+static int compare_u32(const void* a, const void* b){
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(uint32_t* values, size_t count, unsigned per_mille){
+    // values must be sorted
+    return count ? values[(count - 1) * per_mille / 1000] : 0;
+}
+
+// Latencies of one kind of call
+
+typedef struct {
+    uint32_t* values;
+    size_t    count;
+} bench_latency_t;
+
+static void latency_add(bench_latency_t* latency, uint64_t ns){
+    latency->values[latency->count++] = (ns > UINT32_MAX) ? UINT32_MAX : (uint32_t) ns;
+}
+
+static void latency_print(const char* name, bench_latency_t* latency){
+    if(!latency->count) return;
+
+    qsort(latency->values, latency->count, sizeof(uint32_t), compare_u32);
+    printf("  %s p50/p99/p999 %" PRIu32 "/%" PRIu32 "/%" PRIu32 " ns",
+        name, percentile(latency->values, latency->count, 500), percentile(latency->values, latency->count, 990), percentile(latency->values, latency->count, 999));
+}
+
+// Footprint sampling
+
+typedef struct {
+    bool   available;
+    size_t peak_footprint;
+    size_t peak_fragmentation;
+    size_t final_fragmentation;
+} bench_memory_t;
+
+static void memory_sample(const bench_allocator_t* allocator, bench_memory_t* memory){
+    size_t footprint, fragmentation;
+
+    memory->available = allocator->info(&footprint, &fragmentation);
+    if(!memory->available) return;
+
+    if(footprint > memory->peak_footprint) memory->peak_footprint = footprint;
+    if(fragmentation > memory->peak_fragmentation) memory->peak_fragmentation = fragmentation;
+    memory->final_fragmentation = fragmentation;
+}
+
+static void result_print(const char* workload, const bench_allocator_t* allocator, size_t ops, uint64_t elapsed_ns, bench_memory_t* memory){
+    printf("%-10s %-10s %8.2f Mops/s", workload, allocator->name, elapsed_ns ? (double) ops * 1000.0 / (double) elapsed_ns : 0.0);
+
+    if(memory->available){
+        printf("  peak %zu KiB  fragmentation %zu KiB (peak %zu KiB)\n",
+            memory->peak_footprint / 1024, memory->final_fragmentation / 1024, memory->peak_fragmentation / 1024);
+    } else {
+        printf("  peak -  fragmentation -\n");
+    }
+}
+
+// Script replay
+
+static void replay(const bench_allocator_t* allocator, bench_script_t* script, void** slots, bench_latency_t* latencies, bench_memory_t* memory){
+    // latencies is NULL for the throughput run, memory is only sampled when it is not NULL
+    memset(slots, 0, script->slots * sizeof(void*));
+
+    for(size_t i = 0; i < script->count; i++){
+        bench_op_t* op    = &script->ops[i];
+        uint64_t    start = latencies ? now_ns() : 0;
+
+        switch(op->kind){
+            case BENCH_MALLOC:
+                slots[op->slot] = allocator->malloc(op->size);
+                break;
+            case BENCH_FREE:
+                allocator->free(slots[op->slot]);
+                slots[op->slot] = NULL;
+                break;
+            case BENCH_REALLOC: {
+                void* ptr = allocator->realloc(slots[op->slot], op->size);
+
+                // A failed realloc keeps the block
+                if(ptr || !op->size) slots[op->slot] = ptr;
+                break;
+            }
+        }
+
+        if(latencies) latency_add(&latencies[op->kind], now_ns() - start);
+
+        if(op->kind != BENCH_FREE) touch(slots[op->slot], op->size);
+
+        if(memory && i % BENCH_SAMPLE_EVERY == 0) memory_sample(allocator, memory);
+    }
+
+    if(memory) memory_sample(allocator, memory);
+
+    for(size_t slot = 0; slot < script->slots; slot++) allocator->free(slots[slot]);
+}
+
+static bool run_script(const char* workload, const bench_allocator_t* allocator, bench_script_t* script){
+    void**          slots = (void**) malloc(script->slots * sizeof(void*));
+    bench_latency_t latencies[3];
+    bool            done  = false;
+
+    memset(latencies, 0, sizeof(latencies));
+    for(int kind = 0; kind < 3; kind++) latencies[kind].values = (uint32_t*) malloc(script->count * sizeof(uint32_t) + 1);
+
+    if(slots && latencies[0].values && latencies[1].values && latencies[2].values){
+        bench_memory_t memory;
+        memset(&memory, 0, sizeof(memory));
+
+        if(allocator->init(false)){
+            uint64_t start = now_ns();
+            replay(allocator, script, slots, NULL, NULL);
+            uint64_t elapsed = now_ns() - start;
+            allocator->destroy();
+
+            if(allocator->init(false)){
+                replay(allocator, script, slots, latencies, &memory);
+                allocator->destroy();
+
+                result_print(workload, allocator, script->count, elapsed, &memory);
+                latency_print("malloc", &latencies[BENCH_MALLOC]);
+                latency_print("free", &latencies[BENCH_FREE]);
+                latency_print("realloc", &latencies[BENCH_REALLOC]);
+                printf("\n");
+                done = true;
+            }
+        }
+    }
+
+    for(int kind = 0; kind < 3; kind++) free(latencies[kind].values);
+    free(slots);
+
+    if(!done) fprintf(stderr, "%s: %s failed to run\n", workload, allocator->name);
+    return done;
+}
+
+// Synthetic workloads
+
+static bool script_random(bench_script_t* script, size_t ops, bool powerlaw){
+    // Random malloc / free over a fixed number of slots, the live set hovers around half of them
+    bool live[BENCH_SLOTS];
+    memset(live, 0, sizeof(live));
+
+    for(size_t i = 0; i < ops; i++){
+        uint32_t slot = (uint32_t) (rng_next() % BENCH_SLOTS);
+
+        if(live[slot]){
+            if(!script_push(script, BENCH_FREE, slot, 0)) return false;
+        } else {
+            size_t size = powerlaw ? rng_powerlaw() : rng_range(16, 512);
+            if(!script_push(script, BENCH_MALLOC, slot, size)) return false;
+        }
+
+        live[slot] = !live[slot];
+    }
+
+    return true;
+}
+
+static bool script_realloc(bench_script_t* script, size_t ops){
+    // Buffers growing by small steps up to BENCH_REALLOC_LIMIT, then freed
+    size_t sizes[BENCH_REALLOC_SLOTS];
+    memset(sizes, 0, sizeof(sizes));
+
+    for(size_t i = 0; i < ops; i++){
+        uint32_t slot = (uint32_t) (rng_next() % BENCH_REALLOC_SLOTS);
+        bool     pushed;
+
+        if(!sizes[slot]){
+            sizes[slot] = 16;
+            pushed = script_push(script, BENCH_MALLOC, slot, sizes[slot]);
+        } else if(sizes[slot] < BENCH_REALLOC_LIMIT){
+            sizes[slot] += rng_range(16, 256);
+            pushed = script_push(script, BENCH_REALLOC, slot, sizes[slot]);
+        } else {
+            sizes[slot] = 0;
+            pushed = script_push(script, BENCH_FREE, slot, 0);
+        }
+
+        if(!pushed) return false;
+    }
+
+    return true;
+}
+
+// Trace replay
+
+typedef struct {
+    uintptr_t key;      // 0 is an empty entry
+    uint32_t  slot;
+} trace_entry_t;
+
+typedef struct {
+    trace_entry_t* entries;
+    size_t         mask;
+    uint32_t*      free_slots;  // Slots of freed pointers, reused first
+    size_t         free_count;
+    uint32_t       next_slot;
+} trace_map_t;
+
+static inline size_t trace_map_home(trace_map_t* map, uintptr_t key){
+    return (size_t) (key * 0x9E3779B97F4A7C15ull >> 16) & map->mask;
+}
+
+static trace_entry_t* trace_map_find(trace_map_t* map, uintptr_t key){
+    // The entry of key, or the empty entry where it would go
+    size_t index = trace_map_home(map, key);
+
+    while(map->entries[index].key && map->entries[index].key != key) index = (index + 1) & map->mask;
+    return &map->entries[index];
+}
+
+static void trace_map_remove(trace_map_t* map, trace_entry_t* entry){
+    // Backward shift deletion keeps the probe sequences without tombstones
+    size_t hole  = (size_t) (entry - map->entries);
+    size_t index = hole;
+
+    entry->key = 0;
+
+    for(;;){
+        index = (index + 1) & map->mask;
+        if(!map->entries[index].key) return;
+
+        size_t home = trace_map_home(map, map->entries[index].key);
+
+        // The entry can fill the hole if its home is not between the hole and itself
+        if(((index - home) & map->mask) >= ((index - hole) & map->mask)){
+            map->entries[hole] = map->entries[index];
+            map->entries[index].key = 0;
+            hole = index;
+        }
+    }
+}
+
+static void trace_map_insert(trace_map_t* map, uintptr_t key, uint32_t slot){
+    trace_entry_t* entry = trace_map_find(map, key);
+
+    entry->key  = key;
+    entry->slot = slot;
+}
+
+static uint32_t trace_slot_new(trace_map_t* map){
+    return map->free_count ? map->free_slots[--map->free_count] : map->next_slot++;
+}
+
+static bool trace_apply(bench_script_t* script, trace_map_t* map, uintptr_t ptr, uintptr_t new_ptr, size_t size){
+    // One call of the trace: ptr 0 is a malloc, new_ptr 0 a free, both a realloc
+    trace_entry_t* entry = ptr ? trace_map_find(map, ptr) : NULL;
+    uint32_t       slot;
+
+    if(!new_ptr){
+        if(!entry || !entry->key) return true;
+
+        slot = entry->slot;
+        map->free_slots[map->free_count++] = slot;
+        trace_map_remove(map, entry);
+        return script_push(script, BENCH_FREE, slot, 0);
+    }
+
+    if(entry && entry->key){
+        slot = entry->slot;
+        trace_map_remove(map, entry);
+    } else {
+        // Reallocs of unknown pointers are mallocs
+        slot = trace_slot_new(map);
+    }
+
+    trace_map_insert(map, new_ptr, slot);
+    return script_push(script, entry ? BENCH_REALLOC : BENCH_MALLOC, slot, size);
+}
+
+static bool script_trace(bench_script_t* script, const char* path){
+    FILE* file = fopen(path, "rb");
+    if(!file){
+        perror(path);
+        return false;
+    }
+
+    // Binary traces from arena_trace_start begin with a header event
+    arena_trace_event_t event;
+    bool binary = fread(&event, sizeof(event), 1, file) == 1 && event.time_ns == TRACE_MAGIC;
+    rewind(file);
+
+    // Live pointers are at most the number of calls
+    size_t records = 0;
+    char   line[256];
+
+    if(binary){
+        while(fread(&event, sizeof(event), 1, file) == 1) records++;
+    } else {
+        while(fgets(line, sizeof(line), file)) records++;
+    }
+
+    rewind(file);
+
+    size_t capacity = 16;
+    while(capacity < records * 2) capacity <<= 1;
+
+    trace_map_t map;
+    memset(&map, 0, sizeof(map));
+    map.entries    = (trace_entry_t*) calloc(capacity, sizeof(trace_entry_t));
+    map.free_slots = (uint32_t*) malloc((records + 1) * sizeof(uint32_t));
+    map.mask       = capacity - 1;
+
+    bool done = map.entries && map.free_slots;
+
+    while(done && binary && fread(&event, sizeof(event), 1, file) == 1){
+        if(event.time_ns == TRACE_MAGIC) continue;
+        done = trace_apply(script, &map, (uintptr_t) event.ptr, (uintptr_t) event.new_ptr, (size_t) event.size);
+    }
+
+    while(done && !binary && fgets(line, sizeof(line), file)){
+        char*     cursor = line + 1;
+        uintptr_t ptr    = (uintptr_t) strtoull(cursor, &cursor, 16);
+
+        switch(line[0]){
+            case 'm':
+                if(ptr) done = trace_apply(script, &map, 0, ptr, (size_t) strtoull(cursor, NULL, 10));
+                break;
+            case 'f':
+                if(ptr) done = trace_apply(script, &map, ptr, 0, 0);
+                break;
+            case 'r': {
+                // Failed reallocs didn't change anything
+                uintptr_t new_ptr = (uintptr_t) strtoull(cursor, &cursor, 16);
+                if(new_ptr) done = trace_apply(script, &map, ptr, new_ptr, (size_t) strtoull(cursor, NULL, 10));
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    fclose(file);
+    free(map.entries);
+    free(map.free_slots);
+
+    if(done && !script->count) fprintf(stderr, "%s: no calls found\n", path);
+    return done && script->count;
+}
+
+// Producer / consumer
+
+typedef struct {
+    const bench_allocator_t* allocator;
+    size_t          count;
+    void*           ring[BENCH_RING_SIZE];
+    size_t          head;       // Written by the producer
+    size_t          tail;       // Written by the consumer
+    bench_latency_t malloc_latency;
+    bench_latency_t free_latency;
+    bench_memory_t  memory;
+    bool            timed;
+} bench_pipe_t;
+
+static void* consumer_main(void* arg){
+    bench_pipe_t* pipe = (bench_pipe_t*) arg;
+
+    for(size_t i = 0; i < pipe->count; i++){
+        while(__atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) == pipe->tail) sched_yield();
+
+        void*    ptr   = pipe->ring[pipe->tail % BENCH_RING_SIZE];
+        uint64_t start = pipe->timed ? now_ns() : 0;
+
+        pipe->allocator->free(ptr);
+
+        if(pipe->timed) latency_add(&pipe->free_latency, now_ns() - start);
+        __atomic_store_n(&pipe->tail, pipe->tail + 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static void producer_run(bench_pipe_t* pipe){
+    pipe->allocator->owner();
+
+    for(size_t i = 0; i < pipe->count; i++){
+        size_t   size  = rng_range(16, 256);
+        uint64_t start = pipe->timed ? now_ns() : 0;
+        void*    ptr   = pipe->allocator->malloc(size);
+
+        if(pipe->timed) latency_add(&pipe->malloc_latency, now_ns() - start);
+        touch(ptr, size);
+
+        while(pipe->head - __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE) == BENCH_RING_SIZE) sched_yield();
+
+        pipe->ring[pipe->head % BENCH_RING_SIZE] = ptr;
+        __atomic_store_n(&pipe->head, pipe->head + 1, __ATOMIC_RELEASE);
+
+        if(pipe->timed && i % BENCH_SAMPLE_EVERY == 0) memory_sample(pipe->allocator, &pipe->memory);
+    }
+}
+
+static bool pipe_run(bench_pipe_t* pipe){
+    pthread_t consumer;
+
+    pipe->head = 0;
+    pipe->tail = 0;
+
+    if(!pipe->allocator->init(true)) return false;
+
+    if(pthread_create(&consumer, NULL, consumer_main, pipe)){
+        pipe->allocator->destroy();
+        return false;
+    }
+
+    producer_run(pipe);
+    pthread_join(consumer, NULL);
+
+    // The frees queued for the producer are only counted after its next malloc
+    if(pipe->timed){
+        pipe->allocator->free(pipe->allocator->malloc(16));
+        memory_sample(pipe->allocator, &pipe->memory);
+    }
+
+    pipe->allocator->destroy();
+    return true;
+}
+
+static bool run_prodcons(const bench_allocator_t* allocator, size_t ops, uint64_t seed){
+    bench_pipe_t* pipe = (bench_pipe_t*) calloc(1, sizeof(bench_pipe_t));
+    if(!pipe) return false;
+
+    pipe->allocator = allocator;
+    pipe->count     = ops / 2;
+
+    pipe->malloc_latency.values = (uint32_t*) malloc(pipe->count * sizeof(uint32_t) + 1);
+    pipe->free_latency.values   = (uint32_t*) malloc(pipe->count * sizeof(uint32_t) + 1);
+
+    bool done = false;
+
+    if(pipe->malloc_latency.values && pipe->free_latency.values){
+        rng_state = seed;
+        uint64_t start = now_ns();
+
+        if(pipe_run(pipe)){
+            uint64_t elapsed = now_ns() - start;
+
+            rng_state   = seed;
+            pipe->timed = true;
+
+            if(pipe_run(pipe)){
+                result_print("prodcons", allocator, pipe->count * 2, elapsed, &pipe->memory);
+                latency_print("malloc", &pipe->malloc_latency);
+                latency_print("free", &pipe->free_latency);
+                printf("\n");
+                done = true;
+            }
+        }
+    }
+
+    free(pipe->malloc_latency.values);
+    free(pipe->free_latency.values);
+    free(pipe);
+
+    if(!done) fprintf(stderr, "prodcons: %s failed to run\n", allocator->name);
+    return done;
+}
+
+// Driver
+
+static arena_policy_t parse_policy(const char* name){
+    if(!strcmp(name, "tlsf"))  return ARENA_POLICY_TLSF;
+    if(!strcmp(name, "best"))  return ARENA_POLICY_BEST_FIT;
+    if(!strcmp(name, "first")) return ARENA_POLICY_FIRST_FIT;
+    if(!strcmp(name, "next"))  return ARENA_POLICY_NEXT_FIT;
+    return ARENA_POLICY_GOOD_FIT;
+}
+
+static void usage(const char* name){
+    fprintf(stderr, "Usage: %s [-w uniform|powerlaw|realloc|prodcons|all] [-t trace] [-a tinyalloc|system|both]\n"
+                    "       [-n ops] [-s seed] [-m arena_mb] [-p goodfit|tlsf|best|first|next]\n", name);
+}
+
+int main(int argc, char** argv){
+    const char* workload  = "all";
+    const char* trace     = NULL;
+    const char* allocator = "both";
+    size_t      ops       = 1000000;
+    uint64_t    seed      = 88172645463325252ull;
+
+    for(int i = 1; i < argc; i++){
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if(!value || argv[i][0] != '-' || argv[i][2]){
+            usage(argv[0]);
+            return 1;
+        }
+
+        switch(argv[i][1]){
+            case 'w': workload  = value; break;
+            case 't': trace     = value; break;
+            case 'a': allocator = value; break;
+            case 'n': ops       = (size_t) strtoull(value, NULL, 10); break;
+            case 's': seed      = strtoull(value, NULL, 10) | 1; break;
+            case 'm': arena_mb  = (size_t) strtoull(value, NULL, 10); break;
+            case 'p': policy    = parse_policy(value); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+
+        i++;
+    }
+
+    bool all    = !strcmp(workload, "all") && !trace;
+    bool failed = false;
+
+    for(size_t a = 0; a < BENCH_ALLOCATOR_COUNT; a++){
+        if(strcmp(allocator, "both") && strcmp(allocator, allocators[a].name)) continue;
+
+        const char* names[] = { "uniform", "powerlaw", "realloc" };
+
+        for(int w = 0; w < 3; w++){
+            if(!all && strcmp(workload, names[w])) continue;
+
+            bench_script_t script;
+            memset(&script, 0, sizeof(script));
+            rng_state = seed;
+
+            bool built = (w == 2) ? script_realloc(&script, ops) : script_random(&script, ops, w == 1);
+            failed |= !built || !run_script(names[w], &allocators[a], &script);
+            free(script.ops);
+        }
+
+        if(all || !strcmp(workload, "prodcons")) failed |= !run_prodcons(&allocators[a], ops, seed);
+
+        if(trace){
+            bench_script_t script;
+            memset(&script, 0, sizeof(script));
+
+            failed |= !script_trace(&script, trace) || !run_script("trace", &allocators[a], &script);
+            free(script.ops);
+        }
+    }
+
+    return failed ? 1 : 0;
+}
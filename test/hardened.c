@@ -0,0 +1,150 @@
+/**
+ * @file hardened.c
+ * @brief Checks that TINYALLOC_HARDENED reports corrupted blocks to the corruption hook
+ *
+ * Build and run from the repository root, for both block formats:
+ *     cc -DTINYALLOC_HARDENED=1 -I. test/hardened.c tinyalloc.c -lpthread -o hardened && ./hardened
+ *     cc -DTINYALLOC_HARDENED=1 -DTINYALLOC_BOUNDARY_TAGS=1 -I. test/hardened.c tinyalloc.c -lpthread -o hardened && ./hardened
+ *
+ * Every case runs with and without slabs, on an arena configured with a thread cache: sizes the
+ * cache would hold must be checked too. Exits with 1 if a corruption went unreported.
+ */
+
+#include "tinyalloc.h"
+
+#if !TINYALLOC_HARDENED
+#error "Build with -DTINYALLOC_HARDENED=1"
+#endif
+
+#define TEST_ARENA_SIZE (256 * 1024)
+#define TEST_SIZE       32      // Below TCACHE_MAX_SIZE and SLAB_MAX_SIZE on every target
+
+static size_t test_hits;
+static void*  test_last;
+static int    test_failed;
+
+static void on_corruption(void* ctx, void* ptr){
+    (void) ctx;
+
+    test_hits++;
+    test_last = ptr;
+}
+
+static void expect(bool condition, const char* name, bool slab){
+    if(condition) return;
+
+    fprintf(stderr, "FAIL: %s (slab %d)\n", name, (int) slab);
+    test_failed = 1;
+}
+
+static void arena_setup_ex(arena_t* arena_ptr, void* region, bool slab, bool grow){
+    arena_config_t config;
+    memset(&config, 0, sizeof(config));
+
+    config.tcache_count = 16;
+    config.slab         = slab;
+    config.grow         = grow;
+    config.corruption_hooks.on_corruption = on_corruption;
+
+    arena_ptr->start_addr = region;
+    arena_ptr->arena_size = TEST_ARENA_SIZE;
+    arena_init_ex(arena_ptr, &config);
+
+    test_hits = 0;
+    test_last = NULL;
+}
+
+static void arena_setup(arena_t* arena_ptr, void* region, bool slab){
+    arena_setup_ex(arena_ptr, region, slab, false);
+}
+
+static void test_double_free(void* region, bool slab){
+    arena_t arena;
+    arena_setup(&arena, region, slab);
+
+    // The neighbours keep the block (or its slab) in place between the two frees
+    void* before = a_malloc(&arena, TEST_SIZE);
+    void* ptr    = a_malloc(&arena, TEST_SIZE);
+    void* after  = a_malloc(&arena, TEST_SIZE);
+
+    a_free(&arena, ptr);
+    expect(test_hits == 0, "first free is clean", slab);
+
+    a_free(&arena, ptr);
+    expect(test_hits == 1 && test_last == ptr, "double free of a cached size", slab);
+
+    // The block was not handed out twice
+    void* first  = a_malloc(&arena, TEST_SIZE);
+    void* second = a_malloc(&arena, TEST_SIZE);
+    expect(first != second, "double freed block reused once", slab);
+
+    a_free(&arena, before);
+    a_free(&arena, after);
+    arena_destroy(&arena);
+}
+
+static void test_realloc_after_free(void* region, bool slab, bool grow){
+    // A growable arena moves the blocks it can't resize to a chunk
+    arena_t arena;
+    arena_setup_ex(&arena, region, slab, grow);
+
+    void* before = a_malloc(&arena, TEST_SIZE);
+    void* ptr    = a_malloc(&arena, TEST_SIZE);
+    void* after  = a_malloc(&arena, TEST_SIZE);
+
+    a_free(&arena, ptr);
+    expect(!a_realloc(&arena, ptr, 4 * TEST_SIZE), "realloc after free fails", slab);
+    expect(test_hits == 1 && test_last == ptr, "realloc after free reported", slab);
+
+    a_free(&arena, before);
+    a_free(&arena, after);
+    arena_destroy(&arena);
+}
+
+static void test_wild_pointer(void* region, bool slab){
+    arena_t arena;
+    arena_setup(&arena, region, slab);
+
+    void* ptr = a_malloc(&arena, TEST_SIZE);
+    a_malloc(&arena, TEST_SIZE);
+
+    // Inside a live block, but not the start of one
+    a_free(&arena, (char*) ptr + WORDSIZE);
+    expect(test_hits == 1, "free of a pointer inside a block", slab);
+
+    arena_destroy(&arena);
+}
+
+static void test_smashed_header(void* region){
+    // Slab slots have no header, only the blocks are checked
+    arena_t arena;
+    arena_setup(&arena, region, false);
+
+    char* ptr  = (char*) a_malloc(&arena, TEST_SIZE);
+    char* next = (char*) a_malloc(&arena, TEST_SIZE);
+    a_malloc(&arena, TEST_SIZE);
+
+    // Overflow from ptr up to the data of next
+    memset(ptr, 0x41, (size_t) (next - ptr));
+
+    a_free(&arena, next);
+    expect(test_hits == 1 && test_last == next, "free of a block with a smashed header", false);
+
+    arena_destroy(&arena);
+}
+
+int main(void){
+    static size_t region[TEST_ARENA_SIZE / sizeof(size_t)];
+
+    for(int slab = 0; slab < 2; slab++){
+        test_double_free(region, slab);
+        test_realloc_after_free(region, slab, false);
+        test_realloc_after_free(region, slab, true);
+        test_wild_pointer(region, slab);
+    }
+
+    test_smashed_header(region);
+
+    if(!test_failed) puts("hardened ok");
+    return test_failed;
+}
@@ -0,0 +1,179 @@
+/**
+ * @file stress.c
+ * @brief Random malloc, calloc, realloc and free on every policy, checking the blocks and arena_info
+ *
+ * Build and run from the repository root:
+ *     cc -I. test/stress.c tinyalloc.c -lpthread -o stress && ./stress
+ *
+ * Every header layout of the list format, then the boundary tags:
+ *     for links in 0 16 32; do for size in 0 16 32; do for canary in 0 1; do for align in 8 16 32; do
+ *         cc -DTINYALLOC_LINK_BITS=$links -DTINYALLOC_SIZE_BITS=$size -DTINYALLOC_CANARY=$canary \
+ *            -DTINYALLOC_MIN_ALIGN=$align -I. test/stress.c tinyalloc.c -lpthread -o stress && ./stress || exit 1
+ *     done; done; done; done
+ *     cc -DTINYALLOC_BOUNDARY_TAGS=1 -I. test/stress.c tinyalloc.c -lpthread -o stress && ./stress
+ *
+ * Every policy runs with and without slabs. Blocks are filled with a tag and checked whenever
+ * they are touched. An optional argument sets the seed. Exits with 1 on the first failed check.
+ */
+
+#include "tinyalloc.h"
+
+#define TEST_ARENA_SIZE  (1024 * 1024)
+#define TEST_SLOTS       4000
+#define TEST_OPS         100000
+#define TEST_CHECK_EVERY 97
+
+// Blocks are aligned to TINYALLOC_MIN_ALIGN, boundary tags keep the word alignment
+#if TINYALLOC_BOUNDARY_TAGS
+#define TEST_ALIGN sizeof(void*)
+#else
+#define TEST_ALIGN TINYALLOC_MIN_ALIGN
+#endif
+
+static void*         test_ptrs[TEST_SLOTS];
+static size_t        test_sizes[TEST_SLOTS];
+static unsigned char test_tags[TEST_SLOTS];
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void){
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static size_t rng_size(void){
+    // Half of the requests fit a slab
+    return (rng_next() & 1) ? (size_t) (rng_next() % 70) : (size_t) (rng_next() % 4000);
+}
+
+static bool fail(const char* what, arena_policy_t policy, bool slab, int op){
+    fprintf(stderr, "FAIL: %s (policy %d, slab %d, op %d)\n", what, (int) policy, (int) slab, op);
+    return false;
+}
+
+static bool block_valid(arena_t* arena_ptr, void* region, void* ptr, size_t size, size_t align){
+    uintptr_t addr  = (uintptr_t) ptr;
+    uintptr_t start = (uintptr_t) region;
+
+    return addr % align == 0 && addr >= start && addr + size <= start + TEST_ARENA_SIZE
+        && a_usable_size(arena_ptr, ptr) >= size;
+}
+
+static bool block_intact(size_t slot, size_t size){
+    const unsigned char* data = (const unsigned char*) test_ptrs[slot];
+    for(size_t k = 0; k < size; k++) if(data[k] != test_tags[slot]) return false;
+    return true;
+}
+
+static bool info_valid(arena_t* arena_ptr, size_t live_bytes){
+    arena_info_t info;
+    arena_info(arena_ptr, &info);
+
+    return info.used_size <= info.total_size
+        && info.fragmentation_bytes + info.allocated_size == info.used_size
+        && info.allocated_size >= live_bytes
+        && info.peak_allocated_size >= info.allocated_size
+        && info.largest_gap_size <= info.total_size - info.allocated_size;
+}
+
+static bool stress(void* region, arena_policy_t policy, bool slab){
+    arena_t        arena;
+    arena_config_t config;
+    memset(&config, 0, sizeof(config));
+
+    config.policy = policy;
+    config.slab   = slab;
+
+    arena.start_addr = region;
+    arena.arena_size = TEST_ARENA_SIZE;
+    arena_init_ex(&arena, &config);
+
+    size_t live_bytes = 0;
+    bool   ok         = true;
+
+    for(int op = 0; op < TEST_OPS && ok; op++){
+        size_t slot = (size_t) (rng_next() % TEST_SLOTS);
+        size_t size = rng_size();
+
+        if(test_ptrs[slot]){
+            if(!block_intact(slot, test_sizes[slot])){ ok = fail("block overwritten", policy, slab, op); break; }
+
+            if(rng_next() % 3 == 0){
+                a_free(&arena, test_ptrs[slot]);
+                live_bytes -= test_sizes[slot];
+                test_ptrs[slot] = NULL;
+            } else {
+                void* ptr = a_realloc(&arena, test_ptrs[slot], size);
+                if(!ptr) continue;
+
+                // The bytes kept by realloc still hold the tag
+                size_t kept = (size < test_sizes[slot]) ? size : test_sizes[slot];
+                test_ptrs[slot] = ptr;
+                if(!block_intact(slot, kept)){ ok = fail("realloc lost the data", policy, slab, op); break; }
+                if(!block_valid(&arena, region, ptr, size, TEST_ALIGN)){ ok = fail("bad realloc block", policy, slab, op); break; }
+
+                live_bytes += size - test_sizes[slot];
+                test_sizes[slot] = size;
+                memset(ptr, test_tags[slot], size);
+            }
+        } else {
+            int    kind  = (int) (rng_next() % 4);
+            size_t align = (size_t) 64 << (rng_next() % 3);
+            void*  ptr;
+
+            if(kind == 0)      ptr = a_calloc(&arena, 1, size);
+            else if(kind == 1) ptr = a_aligned_alloc(&arena, align, size);
+            else               ptr = a_malloc(&arena, size);
+            if(!ptr) continue;
+
+            test_ptrs[slot]  = ptr;
+            test_sizes[slot] = size;
+            test_tags[slot]  = (unsigned char) rng_next();
+
+            if(kind == 0){
+                const unsigned char* data = (const unsigned char*) ptr;
+                for(size_t k = 0; k < size && ok; k++) if(data[k]) ok = fail("calloc block not zeroed", policy, slab, op);
+            }
+            if(!block_valid(&arena, region, ptr, size, (kind == 1) ? align : TEST_ALIGN)) ok = fail("bad block", policy, slab, op);
+
+            live_bytes += size;
+            memset(ptr, test_tags[slot], size);
+        }
+
+        if(op % TEST_CHECK_EVERY == 0 && ok && !info_valid(&arena, live_bytes)) ok = fail("arena_info out of step", policy, slab, op);
+    }
+
+    for(size_t slot = 0; slot < TEST_SLOTS; slot++){
+        if(!test_ptrs[slot]) continue;
+
+        if(ok && !block_intact(slot, test_sizes[slot])) ok = fail("block overwritten", policy, slab, TEST_OPS);
+        a_free(&arena, test_ptrs[slot]);
+        test_ptrs[slot] = NULL;
+    }
+
+    // Everything was given back: most of the arena is one gap again
+    arena_info_t info;
+    arena_trim(&arena, 0);
+    arena_info(&arena, &info);
+    if(ok && info.largest_gap_size < info.total_size / 2) ok = fail("arena not merged after freeing everything", policy, slab, TEST_OPS);
+
+    arena_destroy(&arena);
+    return ok;
+}
+
+int main(int argc, char** argv){
+    static size_t region[TEST_ARENA_SIZE / sizeof(size_t)] __attribute__((aligned(64)));
+
+    rng_state = (argc > 1) ? strtoull(argv[1], NULL, 10) | 1 : 88172645463325252ull;
+
+    for(int policy = ARENA_POLICY_GOOD_FIT; policy <= ARENA_POLICY_NEXT_FIT; policy++){
+        for(int slab = 0; slab < 2; slab++){
+            if(!stress(region, (arena_policy_t) policy, slab)) return 1;
+        }
+    }
+
+    puts("stress ok");
+    return 0;
+}
@@ -9,311 +9,4074 @@
  * 
  */
 
+// sched_getcpu
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "tinyalloc.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#if TINYALLOC_SAMPLING && (defined(__GLIBC__) || defined(__APPLE__))
+#include <execinfo.h>
+#define SAMPLE_HAS_BACKTRACE 1
+#else
+#define SAMPLE_HAS_BACKTRACE 0
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <time.h>
+#elif defined(_WIN32) && TINYALLOC_GROW
+#include <windows.h>
+#endif
+
 #define PADDING_SIZE (ALIGN_SIZE)
 
+// Blocks are aligned to ALIGN_SIZE (TINYALLOC_MIN_ALIGN), a power of two not below a word.
+// The boundary tags keep the data one word after the tag, so they only use word alignment
+typedef char align_size_valid[(ALIGN_SIZE >= (int) WORDSIZE && !(ALIGN_SIZE & (ALIGN_SIZE - 1)) &&
+                               (!TINYALLOC_BOUNDARY_TAGS || ALIGN_SIZE == (int) WORDSIZE)) ? 1 : -1];
+
 static inline size_t next_padding_size(size_t size){
-    return (size + (PADDING_SIZE - 1) & ~(PADDING_SIZE - 1));
+    return (size + (PADDING_SIZE - 1)) & ~(size_t) (PADDING_SIZE - 1);
+}
+
+static inline uintptr_t align_up(uintptr_t value, uintptr_t align){
+    return (value + (align - 1)) & ~(align - 1);
+}
+
+// Locking
+
+#define SPIN_BACKOFF_MAX 1024
+
+static inline void cpu_relax(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static void spin_lock(int* lock_ptr){
+    // Test and test-and-set: only try to take the lock once it looks free,
+    // backing off exponentially while it is held
+    unsigned int backoff = 1;
+
+    while(__atomic_exchange_n(lock_ptr, 1, __ATOMIC_ACQUIRE)){
+        while(__atomic_load_n(lock_ptr, __ATOMIC_RELAXED)){
+            for(unsigned int i = 0; i < backoff; i++) cpu_relax();
+            if(backoff < SPIN_BACKOFF_MAX) backoff <<= 1;
+        }
+    }
+}
+
+static void spin_unlock(int* lock_ptr){
+    __atomic_store_n(lock_ptr, 0, __ATOMIC_RELEASE);
 }
 
 static void arena_lock(arena_t* arena_ptr){
-    // pthread_mutex_lock(arena_ptr->arena_mutex);
+    switch(arena_ptr->lock_type){
+        case ARENA_LOCK_NONE:
+            break;
+        case ARENA_LOCK_MUTEX:
+#if TINYALLOC_PTHREAD
+            pthread_mutex_lock(&arena_ptr->arena_mutex);
+            break;
+#endif
+            // fall through
+        case ARENA_LOCK_SPIN:
+            spin_lock(&arena_ptr->spinlock);
+            break;
+        case ARENA_LOCK_CUSTOM:
+            arena_ptr->lock_hooks.lock(arena_ptr->lock_hooks.ctx);
+            break;
+    }
 }
 
 static void arena_unlock(arena_t* arena_ptr){
-    // pthread_mutex_unlock(arena_ptr->arena_mutex);
+    switch(arena_ptr->lock_type){
+        case ARENA_LOCK_NONE:
+            break;
+        case ARENA_LOCK_MUTEX:
+#if TINYALLOC_PTHREAD
+            pthread_mutex_unlock(&arena_ptr->arena_mutex);
+            break;
+#endif
+            // fall through
+        case ARENA_LOCK_SPIN:
+            spin_unlock(&arena_ptr->spinlock);
+            break;
+        case ARENA_LOCK_CUSTOM:
+            arena_ptr->lock_hooks.unlock(arena_ptr->lock_hooks.ctx);
+            break;
+    }
 }
 
-void arena_init(arena_t* arena_ptr){
-    arena_ptr->head = NULL;
-    arena_ptr->tail = NULL;
+static void arena_lock_init(arena_t* arena_ptr, const arena_config_t* config){
+    arena_ptr->lock_type = config ? config->lock : ARENA_LOCK_NONE;
+    arena_ptr->spinlock  = 0;
+    memset(&arena_ptr->lock_hooks, 0, sizeof(arena_ptr->lock_hooks));
 
-   // pthread_mutex_init(&arena_ptr->arena_mutex, NULL);
+    switch(arena_ptr->lock_type){
+        case ARENA_LOCK_NONE:
+        case ARENA_LOCK_SPIN:
+            break;
+        case ARENA_LOCK_MUTEX:
+#if TINYALLOC_PTHREAD
+            pthread_mutex_init(&arena_ptr->arena_mutex, NULL);
+#else
+            // No pthread on this target, use the spinlock instead
+            arena_ptr->lock_type = ARENA_LOCK_SPIN;
+#endif
+            break;
+        case ARENA_LOCK_CUSTOM:
+            arena_ptr->lock_hooks = config->lock_hooks;
+            if(arena_ptr->lock_hooks.init) arena_ptr->lock_hooks.init(arena_ptr->lock_hooks.ctx);
+            break;
+    }
 }
 
-void arena_destroy(arena_t* arena_ptr){
-    arena_ptr->head = NULL;
-    arena_ptr->tail = NULL;
-    arena_ptr->arena_size = 0;
-    arena_ptr->start_addr = (void*) 0;
+static void arena_lock_destroy(arena_t* arena_ptr){
+    switch(arena_ptr->lock_type){
+        case ARENA_LOCK_NONE:
+        case ARENA_LOCK_SPIN:
+            break;
+        case ARENA_LOCK_MUTEX:
+#if TINYALLOC_PTHREAD
+            pthread_mutex_destroy(&arena_ptr->arena_mutex);
+#endif
+            break;
+        case ARENA_LOCK_CUSTOM:
+            if(arena_ptr->lock_hooks.destroy) arena_ptr->lock_hooks.destroy(arena_ptr->lock_hooks.ctx);
+            break;
+    }
 
-    // pthread_mutex_destroy(&arena_ptr->arena_mutex);
+    arena_ptr->lock_type = ARENA_LOCK_NONE;
 }
 
-// Allocator helper functions
+// Statistics
+//
+// The block layer keeps the allocated bytes and blocks up to date, so arena_info doesn't
+// walk the blocks. They are kept in stats_arena: the arena itself, or the parent of a chunk.
 
-static inline canary_t compute_canary(allocator_header_t* header_ptr){
-    return (canary_t) header_ptr->size ^ (uintptr_t) header_ptr->prev ^ (uintptr_t) header_ptr->next;
+static inline void stats_block_add(arena_t* arena_ptr, size_t size){
+    arena_t* stats = (arena_t*) arena_ptr->stats_arena;
+
+    stats->allocated_size += size;
+    stats->allocated_blocks++;
+    if(stats->allocated_size > stats->peak_allocated_size) stats->peak_allocated_size = stats->allocated_size;
 }
 
-static inline void* pointer_end_block(allocator_header_t* header_ptr){
-    // | HEADER | <- header_ptr 
-    // | HEADER |
-    // |  DATA  | <- header_ptr + HEADER_LENGTH
-    // |  DATA  |
-    // |  DATA  |
-    // |  FREE  | <- header_ptr + HEADER_LENGTH + header_ptr->size
-    // |  FREE  |
-    // 
-    // 
-    return (void*) ((uintptr_t) header_ptr + HEADER_LENGHT + header_ptr->size);
+static inline void stats_block_remove(arena_t* arena_ptr, size_t size){
+    arena_t* stats = (arena_t*) arena_ptr->stats_arena;
+
+    stats->allocated_size -= size;
+    stats->allocated_blocks--;
 }
 
-static size_t available_block_space(arena_t* arena_ptr, allocator_header_t* header_ptr){
-    if(header_ptr->next){
-        return (size_t) ((uintptr_t) header_ptr->next - (uintptr_t) pointer_end_block(header_ptr));
+static inline void stats_block_resize(arena_t* arena_ptr, size_t old_size, size_t new_size){
+    stats_block_remove(arena_ptr, old_size);
+    stats_block_add(arena_ptr, new_size);
+}
+
+static inline void stats_request(arena_t* arena_ptr, void* ptr){
+    // Allocation requests served with the arena locked
+    if(ptr){
+        arena_ptr->alloc_count++;
     } else {
-        // End of the linked-list
-        return (size_t) ((uintptr_t) arena_ptr->start_addr + arena_ptr->arena_size) - (uintptr_t) pointer_end_block(header_ptr); 
+        arena_ptr->failed_count++;
     }
 }
 
+// Instrumentation
+//
+// Compiled in with TINYALLOC_PROFILE, otherwise the helpers are empty. The counters can be
+// updated from the thread caches without the lock, so they are atomic. The hooks are called
+// with the arena unlocked, the free hook before the block is released.
 
-static inline allocator_header_t* ptr_to_header_ptr(void* ptr){
-    return (allocator_header_t*) ((uintptr_t) ptr - HEADER_LENGHT);
+static inline int prof_bucket(size_t value){
+    // log2 bucket, 0 only for 0
+    return value ? (int) (sizeof(unsigned long long) * 8) - __builtin_clzll((unsigned long long) value) : 0;
 }
 
-static inline size_t compute_block_size(size_t padded_size){
-    return padded_size + HEADER_LENGHT;
+static inline void prof_walk(arena_t* arena_ptr, size_t walk){
+#if TINYALLOC_PROFILE
+    int bucket = prof_bucket(walk);
+    if(bucket >= PROF_WALK_BUCKETS) bucket = PROF_WALK_BUCKETS - 1;
+
+    __atomic_fetch_add(&((arena_t*) arena_ptr->stats_arena)->profile.walk_histogram[bucket], 1, __ATOMIC_RELAXED);
+#else
+    (void) arena_ptr;
+    (void) walk;
+#endif
 }
 
-static inline void* header_to_dataptr(allocator_header_t* header_t){
-    return (void*) ((uintptr_t) header_t + HEADER_LENGHT); 
+static inline void prof_malloc(arena_t* arena_ptr, void* ptr, size_t size){
+#if TINYALLOC_PROFILE
+    __atomic_fetch_add(&arena_ptr->profile.size_histogram[prof_bucket(size)], 1, __ATOMIC_RELAXED);
+    if(ptr && arena_ptr->profile_hooks.on_malloc) arena_ptr->profile_hooks.on_malloc(arena_ptr->profile_hooks.ctx, ptr, size);
+#else
+    (void) arena_ptr;
+    (void) ptr;
+    (void) size;
+#endif
 }
 
-void arena_info(arena_t* arena_ptr, arena_info_t* arena_info_ptr){
+static inline void prof_free(arena_t* arena_ptr, void* ptr){
+#if TINYALLOC_PROFILE
+    if(arena_ptr->profile_hooks.on_free) arena_ptr->profile_hooks.on_free(arena_ptr->profile_hooks.ctx, ptr);
+#else
+    (void) arena_ptr;
+    (void) ptr;
+#endif
+}
 
-    //size_t total_size;
-    //size_t used_size;
-    //size_t allocated_size;
-    //size_t fragmentation_bytes;
-    //size_t allocated_blocks;
+static inline void prof_realloc(arena_t* arena_ptr, void* ptr, void* new_ptr, size_t size){
+    // A moved block is reported as a free and a malloc
+#if TINYALLOC_PROFILE
+    if(!new_ptr) return;
 
-    arena_lock(arena_ptr);
+    if(!ptr){
+        prof_malloc(arena_ptr, new_ptr, size);
+        return;
+    }
 
-    // TODO
-    arena_info_ptr->total_size          = arena_ptr->arena_size;
-    arena_info_ptr->used_size           = 0;
-    arena_info_ptr->allocated_size      = 0;
-    arena_info_ptr->fragmentation_bytes = 0;
-    arena_info_ptr->allocated_blocks    = 0;
+    __atomic_fetch_add((new_ptr == ptr) ? &arena_ptr->profile.realloc_inplace : &arena_ptr->profile.realloc_moved, 1, __ATOMIC_RELAXED);
 
-    if(arena_ptr->head){
-        allocator_header_t* block = (allocator_header_t*) arena_ptr->head;
-        allocator_header_t* last  = NULL;
+    if(new_ptr != ptr){
+        prof_free(arena_ptr, ptr);
+        prof_malloc(arena_ptr, new_ptr, size);
+    }
+#else
+    (void) arena_ptr;
+    (void) ptr;
+    (void) new_ptr;
+    (void) size;
+#endif
+}
 
-        while(block){
-            arena_info_ptr->allocated_size += block->size + HEADER_LENGHT;
-            arena_info_ptr->allocated_blocks++;
-            if(block->next) arena_info_ptr->fragmentation_bytes += available_block_space(arena_ptr, block);
+// Hardening
+//
+// With TINYALLOC_HARDENED the block headers touched by free and realloc, and the gaps
+// visited by the free gap walk, are checked before they are trusted. Every check is one
+// compare per touched header. Slabs keep one bit per live slot, and there is no thread
+// cache: the checks read the neighbours, so they need the arena locked. A failed check
+// calls the corruption handler of the arena, or aborts, and the operation is skipped.
 
-            last  = block;
-            block = (allocator_header_t*) block->next;
-        }
+static uintptr_t canary_secret_random(arena_t* arena_ptr){
+    // The addresses of the arena and of the stack (ASLR), a counter and the clock, mixed
+    static uintptr_t counter;
+    uint64_t value = (uint64_t) (uintptr_t) arena_ptr ^ (uint64_t) (uintptr_t) &value;
+
+    value ^= (uint64_t) __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED) * 0x9E3779B97F4A7C15ull;
+
+#if defined(__unix__) || defined(__APPLE__)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    value ^= (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+#endif
+
+    value ^= value >> 30;
+    value *= 0xBF58476D1CE4E5B9ull;
+    value ^= value >> 27;
+    value *= 0x94D049BB133111EBull;
+    value ^= value >> 31;
+
+    return (uintptr_t) value;
+}
+
+static void arena_harden_init(arena_t* arena_ptr, const arena_config_t* config){
+    arena_ptr->canary_secret = (config && config->canary_secret) ? config->canary_secret : canary_secret_random(arena_ptr);
 
-        arena_info_ptr->used_size = ((uintptr_t) last + HEADER_LENGHT + last->size) - (uintptr_t) arena_ptr->start_addr;
+#if TINYALLOC_HARDENED
+    if(config){
+        arena_ptr->corruption_hooks = config->corruption_hooks;
     } else {
-        arena_info_ptr->total_size = arena_ptr->arena_size;
+        memset(&arena_ptr->corruption_hooks, 0, sizeof(arena_ptr->corruption_hooks));
     }
+#endif
+}
 
-    arena_unlock(arena_ptr);
+#if TINYALLOC_HARDENED
+
+static bool corruption_found(arena_t* arena_ptr, void* ptr){
+    // Always false, so checks can return it
+    if(arena_ptr->corruption_hooks.on_corruption){
+        arena_ptr->corruption_hooks.on_corruption(arena_ptr->corruption_hooks.ctx, ptr);
+    } else {
+        fprintf(stderr, "tinyalloc: corrupted block at %p\n", ptr);
+        abort();
+    }
+
+    return false;
 }
 
+#endif
 
-void* a_malloc(arena_t* arena_ptr, size_t size){
-    // Allocate a free block in the arena. Size 0 is valid
-    arena_lock(arena_ptr);
+// Known zero memory
+//
+// Every arena keeps one range of bytes known to be zero: the untouched end of a zero
+// filled region, or pages purged by the trimmer. Placing a block or writing the free
+// index cuts it, so a_calloc only clears the part of a new block outside of it.
 
-    size_t padded_size = next_padding_size(size);
-    size_t block_size  = compute_block_size(padded_size);
+static void zero_touch(arena_t* arena_ptr, uintptr_t start, uintptr_t end){
+    // [start, end) is about to be written, keep the biggest side of the range
+    if(end <= arena_ptr->zero_start || start >= arena_ptr->zero_end) return;
+
+    uintptr_t below = (start > arena_ptr->zero_start) ? start - arena_ptr->zero_start : 0;
+    uintptr_t above = (arena_ptr->zero_end > end) ? arena_ptr->zero_end - end : 0;
 
-    // Fix C++ compiler error
-    allocator_header_t* actual = (allocator_header_t*) arena_ptr->head;
-    allocator_header_t* prev   = NULL;
+    if(above >= below){
+        arena_ptr->zero_start = (end < arena_ptr->zero_end) ? end : arena_ptr->zero_end;
+    } else {
+        arena_ptr->zero_end = start;
+    }
+}
 
-    // Wait a moment, what happens if head do NOT point to the start of the arena?
-    if((uintptr_t) actual > (uintptr_t) arena_ptr->start_addr){
-        // We have free space in the first location!
-        size_t free_space_start = (uintptr_t) actual - (uintptr_t) arena_ptr->start_addr;
+static void zero_add(arena_t* arena_ptr, uintptr_t start, uintptr_t end){
+    // [start, end) reads as zero, merge it with the range or keep the biggest one
+    if(end <= start) return;
 
-        if(free_space_start >= block_size){
-            // Allocate a block on the start of the linked list and point arena to it!
-            allocator_header_t* newblock = (allocator_header_t*) arena_ptr->start_addr;
-            
-            newblock->size    = padded_size;
-            newblock->prev    = NULL;
-            newblock->next    = arena_ptr->head;
-            newblock->canary  = compute_canary(newblock);
+    if(start <= arena_ptr->zero_end && end >= arena_ptr->zero_start){
+        if(start < arena_ptr->zero_start) arena_ptr->zero_start = start;
+        if(end > arena_ptr->zero_end) arena_ptr->zero_end = end;
+    } else if(end - start > arena_ptr->zero_end - arena_ptr->zero_start){
+        arena_ptr->zero_start = start;
+        arena_ptr->zero_end   = end;
+    }
+}
 
-            // Point the first block of the arena to this newly created one
-            arena_ptr->head = newblock;
+static void zero_clear(void* ptr, size_t size, uintptr_t zero_start, uintptr_t zero_end){
+    // Clear [ptr, ptr + size) but the bytes of the known zero range, memset has the widest stores
+    uintptr_t start = (uintptr_t) ptr;
+    uintptr_t end   = start + size;
 
-            arena_unlock(arena_ptr);
-            return header_to_dataptr(newblock);
-        }
+    if(end <= zero_start || start >= zero_end){
+        memset(ptr, 0, size);
+        return;
     }
 
+    if(start < zero_start) memset(ptr, 0, (size_t) (zero_start - start));
+    if(end > zero_end) memset((void*) zero_end, 0, (size_t) (end - zero_end));
+}
 
-    if(actual){
-        // Transverse the linked-list in search of a free block
-        bool is_contiguous = false;
+// Free gap index
+//
+// Free space is indexed in two level size class bins, so a_malloc doesn't need to walk
+// the blocks. Every free region big enough to hold a block gets a free_gap_t written at
+// its start and is linked in the bin of its size class. Smaller regions can never
+// satisfy an allocation and are not indexed.
 
-        while(actual->next){
-            // TODO: Detect invalid canaries!
-            if(available_block_space(arena_ptr, actual) >= block_size){
-                // Contiguous space available for allocation!
-                is_contiguous = true;
-                break;
-            }
+#if TINYALLOC_BOUNDARY_TAGS
 
-            prev   = actual;
-            // Fix C++ compiler error
-            actual = (allocator_header_t*) actual->next; 
-        }
+// Free blocks: the tag word (size and flags) is the size field, the footer follows the links
+typedef struct free_gap {
+    size_t  size;   // block tag
+    struct free_gap* prev;
+    struct free_gap* next;
+} free_gap_t;
 
-        // Now actual is pointing to the block with free contiguous space
-        // prev is the previous one. last header in the linked-list has the
-        // next pointer to NULL
+#define MIN_GAP_SIZE (sizeof(free_gap_t) + WORDSIZE)
 
-        allocator_header_t* newblock = (allocator_header_t*) pointer_end_block(actual);
+static inline size_t gap_node_size(free_gap_t* gap){
+    return gap->size & ~(size_t) (WORDSIZE - 1);
+}
 
-        uintptr_t arena_end_ptr = (uintptr_t) arena_ptr->start_addr + arena_ptr->arena_size;
+static inline bool gap_is_tail(arena_t* arena_ptr, free_gap_t* gap, size_t size){
+    // The free block right before the end tag
+    return (uintptr_t) gap + size == (uintptr_t) arena_ptr->tail;
+}
 
-        // Wait a moment, do we have enought free memory in the arena?
-        if(((uintptr_t) newblock + padded_size) > arena_end_ptr){
-            // Nope, return NULL
-            arena_unlock(arena_ptr);
-            return NULL;
-        }
+#else
 
-        newblock->size   = padded_size;
-        newblock->prev   = (void*) actual;
-        newblock->next   = (void*) actual->next;
-        newblock->canary = compute_canary(newblock);
+// Gaps between blocks, a gap is owned by the block before it (NULL for the gap at start_addr)
+typedef struct free_gap {
+    size_t  size;   // gap size in bytes
+    void*   owner;  // block before the gap, NULL if the gap starts at start_addr
+    struct free_gap* prev;
+    struct free_gap* next;
+} free_gap_t;
 
+// Smaller headers (tinyalloc_config.h) leave gaps that hold a block but not a free_gap_t
+#define MIN_GAP_SIZE (HEADER_LENGHT > sizeof(free_gap_t) ? HEADER_LENGHT : ((sizeof(free_gap_t) + (ALIGN_SIZE - 1)) & ~(size_t) (ALIGN_SIZE - 1)))
 
-        // Update previous block pointer
-        actual->next = (void*) newblock;
-        // Recompute previous block canary
-        actual->canary = compute_canary(actual);
-
-        if(newblock->next){
-            // Update next block prev pointer to this element
-            // Fix C++ compiler error
-            allocator_header_t* next_ptr = (allocator_header_t*) newblock->next;
-            next_ptr->prev = (void*) newblock;
-            // Recompute next block canary
-            next_ptr->canary = compute_canary(next_ptr);
-        } else {
-            // This is the last block in the linked list, update tail pointer
-            arena_ptr->tail = newblock;
-        }
+static inline size_t gap_node_size(free_gap_t* gap){
+    return gap->size;
+}
 
-        arena_unlock(arena_ptr);
-        return header_to_dataptr(newblock);
+static inline bool gap_is_tail(arena_t* arena_ptr, free_gap_t* gap, size_t size){
+    // The gap owned by the last block
+    (void) size;
+    return gap->owner == arena_ptr->tail;
+}
+
+#endif
+
+// A free_gap_t must fit in the smallest indexed region
+typedef char free_gap_fits[(sizeof(free_gap_t) <= MIN_GAP_SIZE) ? 1 : -1];
+
+static inline int floor_log2(size_t value){
+    return (int) (sizeof(unsigned long long) * 8 - 1) - __builtin_clzll((unsigned long long) value);
+}
+
+static inline int lowest_bit(unsigned long long value){
+    return __builtin_ctzll(value);
+}
+
+// Maps a size to its first level (power of two) and second level (linear subdivision) bin
+static inline void gap_mapping(size_t size, int* fl, int* sl){
+    *fl = floor_log2(size);
+
+    if(*fl < FREE_SL_LOG2){
+        *sl = (int) (size << (FREE_SL_LOG2 - *fl)) & (FREE_SL_COUNT - 1);
+    } else {
+        *sl = (int) (size >> (*fl - FREE_SL_LOG2)) & (FREE_SL_COUNT - 1);
+    }
+}
+
+static void bin_insert(arena_t* arena_ptr, free_gap_t* gap, size_t size){
+    int fl, sl;
+    gap_mapping(size, &fl, &sl);
+
+    zero_touch(arena_ptr, (uintptr_t) gap, (uintptr_t) gap + sizeof(free_gap_t));
+
+    gap->prev = NULL;
+    gap->next = (free_gap_t*) arena_ptr->free_bins[fl][sl];
+
+    if(gap->next) gap->next->prev = gap;
+
+    arena_ptr->free_bins[fl][sl] = (void*) gap;
+    arena_ptr->free_sl_bitmap[fl] |= (uint32_t) 1 << sl;
+    arena_ptr->free_fl_bitmap     |= (size_t) 1 << fl;
+
+    // The gap after the last block is tracked on its own, the bound covers all the others
+    if(gap_is_tail(arena_ptr, gap, size)){
+        arena_ptr->tail_gap = (void*) gap;
+    } else if(size > arena_ptr->gap_bound){
+        arena_ptr->gap_bound = size;
+    }
+}
+
+static void bin_remove(arena_t* arena_ptr, free_gap_t* gap, size_t size){
+    int fl, sl;
+    gap_mapping(size, &fl, &sl);
+
+    if(arena_ptr->tail_gap == (void*) gap) arena_ptr->tail_gap = NULL;
+
+    if(gap->prev){
+        gap->prev->next = gap->next;
     } else {
-        // First block!
-        if(block_size > arena_ptr->arena_size){
-            arena_unlock(arena_ptr);
-            return NULL; // Out of memory
+        arena_ptr->free_bins[fl][sl] = (void*) gap->next;
+
+        if(!gap->next){
+            // Bin is now empty
+            arena_ptr->free_sl_bitmap[fl] &= ~((uint32_t) 1 << sl);
+            if(!arena_ptr->free_sl_bitmap[fl]) arena_ptr->free_fl_bitmap &= ~((size_t) 1 << fl);
         }
-        // Allocate block
-        allocator_header_t* newblock = (allocator_header_t*) arena_ptr->start_addr;
+    }
+
+    if(gap->next) gap->next->prev = gap->prev;
+}
 
-        newblock->size   = padded_size;
-        newblock->prev   = NULL;
-        newblock->next   = NULL;
-        newblock->canary = compute_canary(newblock);
+// First non-empty bin starting at (fl, sl), every gap in it is at least as big as the bin start
+static free_gap_t* gap_index_search(arena_t* arena_ptr, int fl, int sl){
+    uint32_t sl_map = (sl < FREE_SL_COUNT) ? arena_ptr->free_sl_bitmap[fl] & (~(uint32_t) 0 << sl) : 0;
 
-        // Update head and tail pointers
-        arena_ptr->head = newblock;
-        arena_ptr->tail = newblock;
+    if(!sl_map){
+        // Nothing left in this first level, look in the bigger ones
+        size_t fl_map = (fl + 1 < (int) FREE_FL_COUNT) ? arena_ptr->free_fl_bitmap & (~(size_t) 0 << (fl + 1)) : 0;
+        if(!fl_map) return NULL;
 
-        arena_unlock(arena_ptr);
-        return header_to_dataptr(newblock);
+        fl     = lowest_bit(fl_map);
+        sl_map = arena_ptr->free_sl_bitmap[fl];
     }
+
+    return (free_gap_t*) arena_ptr->free_bins[fl][lowest_bit(sl_map)];
 }
 
+static size_t gap_index_limit(arena_t* arena_ptr){
+    // Last size of the biggest non-empty bin, no indexed gap is bigger
+    if(!arena_ptr->free_fl_bitmap) return 0;
 
-void* a_realloc(arena_t* arena_ptr, void* ptr, size_t size){
-    if(!ptr) return a_malloc(arena_ptr, size);
+    int fl = floor_log2((size_t) arena_ptr->free_fl_bitmap);
+    int sl = floor_log2((size_t) arena_ptr->free_sl_bitmap[fl]);
 
-    arena_lock(arena_ptr);
+    size_t base = (size_t) 1 << fl;
+    if(fl < FREE_SL_LOG2) return base + ((size_t) sl >> (FREE_SL_LOG2 - fl));
 
-    // TODO: Verify canary!
-    allocator_header_t* header_ptr = ptr_to_header_ptr(ptr);
-    
-    size_t newsize_padded   = next_padding_size(size);
-    size_t actual_size      = header_ptr->size;
+    return base + ((size_t) (sl + 1) << (fl - FREE_SL_LOG2)) - 1;
+}
 
-    if(newsize_padded <= actual_size){
-        // Shrink data! This causes fragmentation!
-        header_ptr->size   = newsize_padded;
-        header_ptr->canary = compute_canary(header_ptr);
-        arena_unlock(arena_ptr);
-        return header_to_dataptr(header_ptr);
-    } else {
-        // We need more data, first check if available in contiguous region
-        size_t available_to_next = available_block_space(arena_ptr, header_ptr);
-        size_t required          = newsize_padded - actual_size;
-        
-        if(available_to_next >= required){
-            // Nice, we have enough memory, resize block to new size
-            header_ptr->size   = newsize_padded;
-            header_ptr->canary = compute_canary(header_ptr);
-            arena_unlock(arena_ptr);
-            return header_to_dataptr(header_ptr);
-        } else {
-            // Not enought... Malloc / copy and free block
-            // This creates A LOT of fragmentation
-            // First, unlock the arena to allow relock via a_malloc function
-            arena_unlock(arena_ptr);
-            // Padding size will be maintained
-            void* new_block = (void*) a_malloc(arena_ptr, newsize_padded);
+static size_t gap_index_largest(arena_t* arena_ptr){
+    // Biggest indexed gap, only the biggest non-empty bin is walked
+    if(!arena_ptr->free_fl_bitmap) return 0;
 
-            if(new_block){
-                // Copy data to the new block atomically
-                arena_lock(arena_ptr);
-                memcpy(new_block, ptr, actual_size);
-                arena_unlock(arena_ptr);
-                // Free this block
-                a_free(arena_ptr, ptr);
-                
-                return new_block;
-            } else {
-                return NULL;
+    int fl = floor_log2((size_t) arena_ptr->free_fl_bitmap);
+    int sl = floor_log2((size_t) arena_ptr->free_sl_bitmap[fl]);
+
+    size_t largest = 0;
+
+    for(free_gap_t* gap = (free_gap_t*) arena_ptr->free_bins[fl][sl]; gap; gap = gap->next){
+        if(gap_node_size(gap) > largest) largest = gap_node_size(gap);
+    }
+
+    return largest;
+}
+
+static inline bool gap_verify(arena_t* arena_ptr, free_gap_t* gap){
+    // A gap visited by the walk must be linked back by the next one
+#if TINYALLOC_HARDENED
+    return !gap || !gap->next || gap->next->prev == gap || corruption_found(arena_ptr, gap);
+#else
+    (void) arena_ptr;
+    (void) gap;
+    return true;
+#endif
+}
+
+static free_gap_t* gap_index_best(arena_t* arena_ptr, size_t block_size){
+    // Smallest gap that fits: in the bin of the request, or else in the next non-empty bin
+    int fl, sl;
+    gap_mapping(block_size, &fl, &sl);
+
+    free_gap_t* best = NULL;
+    size_t      walk = 0;
+
+    for(free_gap_t* gap = (free_gap_t*) arena_ptr->free_bins[fl][sl]; gap; gap = gap->next, walk++){
+        if(!gap_verify(arena_ptr, gap)) return NULL;
+        if(gap_node_size(gap) >= block_size && (!best || gap_node_size(gap) < gap_node_size(best))) best = gap;
+    }
+
+    if(!best){
+        // Every gap of a bigger bin fits
+        for(free_gap_t* gap = gap_index_search(arena_ptr, fl, sl + 1); gap; gap = gap->next, walk++){
+            if(!gap_verify(arena_ptr, gap)) return NULL;
+            if(!best || gap_node_size(gap) < gap_node_size(best)) best = gap;
+        }
+    }
+
+    prof_walk(arena_ptr, walk);
+    return best;
+}
+
+static free_gap_t* gap_index_lowest(arena_t* arena_ptr, size_t block_size, uintptr_t from){
+    // Lowest addressed gap at or after from that fits, every gap of the bins that can fit is visited
+    int fl, sl;
+    gap_mapping(block_size, &fl, &sl);
+
+    free_gap_t* best = NULL;
+    size_t      walk = 0;
+
+    for(; fl < (int) FREE_FL_COUNT; fl++, sl = 0){
+        if(!(arena_ptr->free_fl_bitmap & ((size_t) 1 << fl))) continue;
+
+        uint32_t sl_map = arena_ptr->free_sl_bitmap[fl] & (~(uint32_t) 0 << sl);
+
+        while(sl_map){
+            int bin = lowest_bit(sl_map);
+            sl_map &= sl_map - 1;
+
+            for(free_gap_t* gap = (free_gap_t*) arena_ptr->free_bins[fl][bin]; gap; gap = gap->next, walk++){
+                if(!gap_verify(arena_ptr, gap)) return NULL;
+
+                if((uintptr_t) gap >= from && (!best || gap < best) && gap_node_size(gap) >= block_size) best = gap;
             }
         }
     }
+
+    prof_walk(arena_ptr, walk);
+    return best;
 }
 
-void a_free(arena_t* arena_ptr, void* ptr){
-    if(!ptr) return; // Avoid NULL pointers? Will this be needed?
-    arena_lock(arena_ptr);
+static free_gap_t* gap_index_policy(arena_t* arena_ptr, size_t block_size){
+    int fl, sl;
 
-    allocator_header_t* header_ptr = ptr_to_header_ptr(ptr);
+    if(arena_ptr->policy == ARENA_POLICY_BEST_FIT)  return gap_index_best(arena_ptr, block_size);
+    if(arena_ptr->policy == ARENA_POLICY_FIRST_FIT) return gap_index_lowest(arena_ptr, block_size, 0);
 
-    // Find next block and relink the linked-list
-    if(header_ptr->prev){
-        // Previous block exists
-        allocator_header_t* header_prev = (allocator_header_t*) header_ptr->prev;
-        header_prev->next = (void*) header_ptr->next;
-    } else {
-        // First block of the linked list!
-        // FIX: What happens if we free the first block? Fragmentation on the start?
-        // It's probably fixed, lets see 
+    if(arena_ptr->policy == ARENA_POLICY_NEXT_FIT){
+        // Continue after the last block placed, then wrap around to the start
+        free_gap_t* gap = gap_index_lowest(arena_ptr, block_size, arena_ptr->rover);
+        if(!gap && arena_ptr->rover) gap = gap_index_lowest(arena_ptr, block_size, 0);
 
-        arena_ptr->head = (void*) header_ptr->next;
+        if(gap) arena_ptr->rover = (uintptr_t) gap + block_size;
+        return gap;
     }
 
-    if(header_ptr->next){
-        allocator_header_t* header_next = (allocator_header_t*) header_ptr->next;
-        header_next->prev = header_ptr->prev;
+    if(arena_ptr->policy == ARENA_POLICY_TLSF){
+        // Round the request up to the next bin so the first gap found always fits
+        int  size_fl = floor_log2(block_size);
+        size_t round = (size_fl > FREE_SL_LOG2) ? ((size_t) 1 << (size_fl - FREE_SL_LOG2)) - 1 : 0;
+
+        if(block_size + round < block_size) return NULL;
+        gap_mapping(block_size + round, &fl, &sl);
+
+        prof_walk(arena_ptr, 0);
+
+        free_gap_t* gap = gap_index_search(arena_ptr, fl, sl);
+        return gap_verify(arena_ptr, gap) ? gap : NULL;
+    }
+
+    // Gaps in the bin of the request can still be too small, take the first fit
+    gap_mapping(block_size, &fl, &sl);
+
+    free_gap_t* gap  = (free_gap_t*) arena_ptr->free_bins[fl][sl];
+    size_t      walk = 0;
+
+    while(gap){
+        if(!gap_verify(arena_ptr, gap)) return NULL;
+
+        if(gap_node_size(gap) >= block_size){
+            prof_walk(arena_ptr, walk);
+            return gap;
+        }
+
+        gap = gap->next;
+        walk++;
+    }
+
+    // Any gap in a bigger bin fits, take the smallest one available
+    prof_walk(arena_ptr, walk);
+
+    gap = gap_index_search(arena_ptr, fl, sl + 1);
+    return gap_verify(arena_ptr, gap) ? gap : NULL;
+}
+
+static free_gap_t* gap_index_find(arena_t* arena_ptr, size_t block_size){
+    // The bins also bound the gaps, this catches the frees and merges that shrank the biggest gap
+    size_t limit = gap_index_limit(arena_ptr);
+    if(limit < arena_ptr->gap_bound) arena_ptr->gap_bound = limit;
+
+    free_gap_t* tail     = (free_gap_t*) arena_ptr->tail_gap;
+    bool        tail_fit = tail && gap_node_size(tail) >= block_size;
+
+    // Append after the last block when asked to, or when no other gap is big enough
+    if(tail_fit && (arena_ptr->prefer_tail || block_size > arena_ptr->gap_bound)){
+        prof_walk(arena_ptr, 0);
+        return gap_verify(arena_ptr, tail) ? tail : NULL;
+    }
+
+    // Impossible requests are rejected without looking at the bins
+    if(block_size > arena_ptr->gap_bound){
+        prof_walk(arena_ptr, 0);
+        return NULL;
+    }
+
+    free_gap_t* gap = gap_index_policy(arena_ptr, block_size);
+
+    // Every policy but TLSF only fails when no gap fits, so the bound can be lowered
+    if(!gap && arena_ptr->policy != ARENA_POLICY_TLSF) arena_ptr->gap_bound = block_size - 1;
+    return gap;
+}
+
+
+#if TINYALLOC_BOUNDARY_TAGS
+
+// Boundary tag block format
+//
+// Blocks follow each other from the start of the arena, each one starting with a tag
+// word holding its total size and the in-use bits of the block and of the one before
+// it. Free blocks also keep their size in their last word (the footer) and their
+// free_gap_t links after the tag, so a_free finds and merges both neighbours in
+// constant time. A 0 sized in-use tag at the end of the arena stops the walk.
+//
+// | TAG  | <- block
+// | DATA | <- block + WORDSIZE
+// | ...  |
+// | TAG  | <- block + size (next block)
+
+#define TAG_INUSE       ((size_t) 1)
+#define TAG_PREV_INUSE  ((size_t) 2)
+#define TAG_BITS        (TAG_INUSE | TAG_PREV_INUSE)
+
+static inline size_t* block_tag(void* block){
+    return (size_t*) block;
+}
+
+static inline size_t tag_size(size_t tag){
+    return tag & ~TAG_BITS;
+}
+
+static inline void* tag_next_block(void* block){
+    return (void*) ((uintptr_t) block + tag_size(*block_tag(block)));
+}
+
+static inline void* tag_prev_block(void* block){
+    // Only valid if the previous block is free, its footer is the word before block
+    return (void*) ((uintptr_t) block - *((size_t*) block - 1));
+}
+
+static inline void* tag_to_dataptr(void* block){
+    return (void*) ((uintptr_t) block + WORDSIZE);
+}
+
+static inline void* dataptr_to_tag(void* ptr){
+    return (void*) ((uintptr_t) ptr - WORDSIZE);
+}
+
+static inline size_t tag_block_size(size_t size){
+    // Total size of a block with size data bytes, 0 on overflow
+    size_t padded_size = next_padding_size(size);
+    size_t block_size  = padded_size + WORDSIZE;
+
+    if(padded_size < size || block_size < padded_size) return 0;
+    return block_size < MIN_GAP_SIZE ? MIN_GAP_SIZE : block_size;
+}
+
+static inline void tag_set_prev_inuse(void* block, bool prev_inuse){
+    // block can be a live block read without the lock (thread cache), only its flags change
+    if(prev_inuse){
+        __atomic_fetch_or(block_tag(block), TAG_PREV_INUSE, __ATOMIC_RELAXED);
     } else {
-        // Update tail pointer, freeing last block
-        arena_ptr->tail = header_ptr->prev;
+        __atomic_fetch_and(block_tag(block), ~TAG_PREV_INUSE, __ATOMIC_RELAXED);
+    }
+}
+
+static inline size_t block_usable_size(void* ptr){
+    return tag_size(__atomic_load_n(block_tag(dataptr_to_tag(ptr)), __ATOMIC_RELAXED)) - WORDSIZE;
+}
+
+static size_t block_inplace_size(arena_t* arena_ptr, void* ptr){
+    // Biggest size the block can be resized to without moving it
+    (void) arena_ptr;
+
+    void*  block    = dataptr_to_tag(ptr);
+    size_t size     = tag_size(*block_tag(block));
+    size_t next_tag = *block_tag(tag_next_block(block));
+
+    if(!(next_tag & TAG_INUSE)) size += tag_size(next_tag);
+    return size - WORDSIZE;
+}
+
+static void tag_make_free(arena_t* arena_ptr, void* block, size_t size){
+    // block is preceded by an in-use block, free blocks are always merged
+    zero_touch(arena_ptr, (uintptr_t) block + size - WORDSIZE, (uintptr_t) block + size);
+
+    *block_tag(block) = size | TAG_PREV_INUSE;
+    *(size_t*) ((uintptr_t) block + size - WORDSIZE) = size;
+
+    bin_insert(arena_ptr, (free_gap_t*) block, size);
+
+    tag_set_prev_inuse((void*) ((uintptr_t) block + size), false);
+}
+
+static void* tag_place(arena_t* arena_ptr, void* block, size_t free_size, size_t block_size, size_t prev_inuse){
+    // Use block_size bytes at the start of the (unindexed) free block, the rest is a new free block
+    if(free_size - block_size >= MIN_GAP_SIZE){
+        *block_tag(block) = block_size | TAG_INUSE | prev_inuse;
+        tag_make_free(arena_ptr, (void*) ((uintptr_t) block + block_size), free_size - block_size);
+    } else {
+        *block_tag(block) = free_size | TAG_INUSE | prev_inuse;
+        tag_set_prev_inuse(tag_next_block(block), true);
     }
 
-    arena_unlock(arena_ptr);
-}
\ No newline at end of file
+    stats_block_add(arena_ptr, tag_size(*block_tag(block)));
+    zero_touch(arena_ptr, (uintptr_t) block, (uintptr_t) tag_next_block(block));
+
+    return tag_to_dataptr(block);
+}
+
+// Largest data size of a block and largest region the tags can hold
+#define BLOCK_SIZE_MAX   ((size_t) SIZE_MAX & ~((size_t) WORDSIZE - 1))
+#define BLOCK_REGION_MAX ((size_t) SIZE_MAX)
+
+static void block_format_init(arena_t* arena_ptr){
+    uintptr_t first = align_up((uintptr_t) arena_ptr->start_addr, WORDSIZE);
+    uintptr_t end   = ((uintptr_t) arena_ptr->start_addr + arena_ptr->arena_size) & ~((uintptr_t) WORDSIZE - 1);
+
+    // Room for the end tag
+    if(end < first + WORDSIZE) return;
+    end -= WORDSIZE;
+
+    zero_touch(arena_ptr, end, end + WORDSIZE);
+    *block_tag((void*) end) = TAG_INUSE;
+
+    arena_ptr->head = (void*) first;
+    arena_ptr->tail = (void*) end;
+
+    if(end - first >= MIN_GAP_SIZE){
+        tag_make_free(arena_ptr, (void*) first, (size_t) (end - first));
+    } else {
+        *block_tag((void*) end) |= TAG_PREV_INUSE;
+    }
+}
+
+static size_t block_tail_gap(arena_t* arena_ptr){
+    // Free bytes after the last live block
+    if(!arena_ptr->tail) return arena_ptr->arena_size;
+
+    uintptr_t end  = (uintptr_t) arena_ptr->start_addr + arena_ptr->arena_size;
+    size_t    tail = *block_tag(arena_ptr->tail);
+    size_t    gap  = (size_t) (end - (uintptr_t) arena_ptr->tail);
+
+    // The footer of the free block before the end tag has its size
+    if(!(tail & TAG_PREV_INUSE)) gap += *(size_t*) ((uintptr_t) arena_ptr->tail - WORDSIZE);
+    return gap;
+}
+
+static inline bool block_arena_empty(arena_t* arena_ptr){
+    // A single free block from the start to the end tag
+    void* block = arena_ptr->head;
+    return !block || (!(*block_tag(block) & TAG_INUSE) && tag_next_block(block) == arena_ptr->tail);
+}
+
+// Core allocator, the arena must be locked by the caller
+
+static void* block_malloc(arena_t* arena_ptr, size_t size){
+    size_t block_size = tag_block_size(size);
+    if(!block_size) return NULL;
+
+    free_gap_t* gap = gap_index_find(arena_ptr, block_size);
+    if(!gap) return NULL;
+
+    size_t free_size = gap_node_size(gap);
+    bin_remove(arena_ptr, gap, free_size);
+
+    return tag_place(arena_ptr, (void*) gap, free_size, block_size, TAG_PREV_INUSE);
+}
+
+static void* block_memalign(arena_t* arena_ptr, size_t align, size_t size){
+    // Allocate a block whose data is aligned to align (power of two)
+    if(align <= (size_t) ALIGN_SIZE) return block_malloc(arena_ptr, size);
+
+    size_t block_size  = tag_block_size(size);
+    size_t search_size = block_size + align + MIN_GAP_SIZE;
+
+    // Size overflow
+    if(!block_size || search_size < block_size) return NULL;
+
+    // Any free block this big has room for a leading free block and the aligned one
+    free_gap_t* gap = gap_index_find(arena_ptr, search_size);
+    if(!gap) return NULL;
+
+    size_t    free_size = gap_node_size(gap);
+    uintptr_t data      = align_up((uintptr_t) gap + WORDSIZE, align);
+
+    // The space before the block must be empty or big enough to be a free block
+    while(data - WORDSIZE - (uintptr_t) gap != 0 && data - WORDSIZE - (uintptr_t) gap < MIN_GAP_SIZE) data += align;
+
+    size_t lead = (size_t) (data - WORDSIZE - (uintptr_t) gap);
+    bin_remove(arena_ptr, gap, free_size);
+
+    if(!lead) return tag_place(arena_ptr, (void*) gap, free_size, block_size, TAG_PREV_INUSE);
+
+    tag_make_free(arena_ptr, (void*) gap, lead);
+    return tag_place(arena_ptr, dataptr_to_tag((void*) data), free_size - lead, block_size, 0);
+}
+
+static inline bool block_verify(arena_t* arena_ptr, void* ptr){
+    // The block must be in use and inside the arena, its neighbours must agree with its tag
+#if TINYALLOC_HARDENED
+    uintptr_t block = (uintptr_t) dataptr_to_tag(ptr);
+    size_t    tag   = *block_tag((void*) block);
+    size_t    size  = tag_size(tag);
+
+    bool valid = (tag & TAG_INUSE) && !(size & (WORDSIZE - 1)) && size >= MIN_GAP_SIZE &&
+                 block >= (uintptr_t) arena_ptr->head && size <= (uintptr_t) arena_ptr->tail - block &&
+                 (*block_tag((void*) (block + size)) & TAG_PREV_INUSE);
+
+    if(valid && !(tag & TAG_PREV_INUSE)){
+        // Free blocks always follow an in-use block
+        size_t footer = *((size_t*) block - 1);
+        valid = footer >= MIN_GAP_SIZE && footer <= block - (uintptr_t) arena_ptr->head &&
+                *block_tag((void*) (block - footer)) == (footer | TAG_PREV_INUSE);
+    }
+
+    return valid || corruption_found(arena_ptr, ptr);
+#else
+    (void) arena_ptr;
+    (void) ptr;
+    return true;
+#endif
+}
+
+static void block_free(arena_t* arena_ptr, void* ptr){
+    if(!block_verify(arena_ptr, ptr)) return;
+
+    void*  block = dataptr_to_tag(ptr);
+    size_t tag   = *block_tag(block);
+    size_t size  = tag_size(tag);
+
+    stats_block_remove(arena_ptr, size);
+
+    // Merge with the next block if it is free
+    void*  next     = tag_next_block(block);
+    size_t next_tag = *block_tag(next);
+
+    if(!(next_tag & TAG_INUSE)){
+        bin_remove(arena_ptr, (free_gap_t*) next, tag_size(next_tag));
+        size += tag_size(next_tag);
+    }
+
+    // And with the previous one
+    if(!(tag & TAG_PREV_INUSE)){
+        void*  prev      = tag_prev_block(block);
+        size_t prev_size = tag_size(*block_tag(prev));
+
+        bin_remove(arena_ptr, (free_gap_t*) prev, prev_size);
+        block = prev;
+        size += prev_size;
+    }
+
+    tag_make_free(arena_ptr, block, size);
+}
+
+static size_t block_malloc_batch(arena_t* arena_ptr, size_t size, size_t count, void** out){
+    size_t block_size = tag_block_size(size);
+    if(!block_size) return 0;
+
+    size_t done = 0;
+
+    while(done < count){
+        // Look for a gap holding all the remaining blocks, or at least one
+        size_t wanted = count - done;
+        if(wanted > SIZE_MAX / block_size) wanted = SIZE_MAX / block_size;
+
+        free_gap_t* gap = gap_index_find(arena_ptr, wanted * block_size);
+        if(!gap) gap = gap_index_find(arena_ptr, block_size);
+        if(!gap) break;
+
+        size_t free_size = gap_node_size(gap);
+        size_t run       = free_size / block_size;
+        if(run > count - done) run = count - done;
+
+        bin_remove(arena_ptr, gap, free_size);
+
+        // Carve the run from the start of the gap, the last block takes care of the rest
+        uintptr_t block = (uintptr_t) gap;
+        zero_touch(arena_ptr, block, block + (run - 1) * block_size);
+
+        for(size_t i = 1; i < run; i++){
+            *block_tag((void*) block) = block_size | TAG_INUSE | TAG_PREV_INUSE;
+            stats_block_add(arena_ptr, block_size);
+            out[done++]  = tag_to_dataptr((void*) block);
+            block       += block_size;
+            free_size   -= block_size;
+        }
+
+        out[done++] = tag_place(arena_ptr, (void*) block, free_size, block_size, TAG_PREV_INUSE);
+    }
+
+    return done;
+}
+
+static inline bool block_is_next(arena_t* arena_ptr, void* ptr, void* next_ptr){
+    // True if next_ptr is the block right after ptr
+    (void) arena_ptr;
+
+    return tag_next_block(dataptr_to_tag(ptr)) == dataptr_to_tag(next_ptr);
+}
+
+static void block_free_run(arena_t* arena_ptr, void** ptrs, size_t count){
+    // Neighbours are merged by every free, so no batching is needed
+    for(size_t i = 0; i < count; i++) block_free(arena_ptr, ptrs[i]);
+}
+
+static void* block_realloc(arena_t* arena_ptr, void* ptr, size_t size){
+    if(!ptr) return block_malloc(arena_ptr, size);
+
+    size_t block_size = tag_block_size(size);
+    if(!block_size || !block_verify(arena_ptr, ptr)) return NULL;
+
+    void*   block      = dataptr_to_tag(ptr);
+    size_t  tag        = *block_tag(block);
+    size_t  actual     = tag_size(tag);
+    void*   next       = tag_next_block(block);
+    size_t  next_tag   = *block_tag(next);
+    size_t  available  = actual + ((next_tag & TAG_INUSE) ? 0 : tag_size(next_tag));
+
+    if(block_size <= available){
+        // Shrink, or grow into the free block after this one
+        if(!(next_tag & TAG_INUSE)) bin_remove(arena_ptr, (free_gap_t*) next, tag_size(next_tag));
+
+        if(available - block_size >= MIN_GAP_SIZE){
+            *block_tag(block) = block_size | (tag & TAG_BITS);
+            tag_make_free(arena_ptr, (void*) ((uintptr_t) block + block_size), available - block_size);
+        } else if(available != actual){
+            *block_tag(block) = available | (tag & TAG_BITS);
+            tag_set_prev_inuse(tag_next_block(block), true);
+        }
+
+        stats_block_resize(arena_ptr, actual, tag_size(*block_tag(block)));
+        zero_touch(arena_ptr, (uintptr_t) block, (uintptr_t) tag_next_block(block));
+        return ptr;
+    }
+
+    // Grow into the free block before this one, sliding the data down
+    if(!(tag & TAG_PREV_INUSE)){
+        void*  prev      = tag_prev_block(block);
+        size_t prev_tag  = *block_tag(prev);
+        size_t total     = tag_size(prev_tag) + available;
+
+        if(block_size <= total){
+            bin_remove(arena_ptr, (free_gap_t*) prev, tag_size(prev_tag));
+            if(!(next_tag & TAG_INUSE)) bin_remove(arena_ptr, (free_gap_t*) next, tag_size(next_tag));
+
+            zero_touch(arena_ptr, (uintptr_t) prev, (uintptr_t) block);
+            memmove(tag_to_dataptr(prev), ptr, actual - WORDSIZE);
+            stats_block_remove(arena_ptr, actual);
+            return tag_place(arena_ptr, prev, total, block_size, prev_tag & TAG_PREV_INUSE);
+        }
+    }
+
+    // Not enought... Malloc / copy and free block
+    void* new_block = block_malloc(arena_ptr, size);
+
+    if(new_block){
+        memcpy(new_block, ptr, actual - WORDSIZE);
+        block_free(arena_ptr, ptr);
+    }
+
+    return new_block;
+}
+
+// Live blocks in address order, for compaction
+
+static void* block_live_from(arena_t* arena_ptr, void* block){
+    while(block && block != arena_ptr->tail){
+        if(*block_tag(block) & TAG_INUSE) return tag_to_dataptr(block);
+        block = tag_next_block(block);
+    }
+
+    return NULL;
+}
+
+static inline void* block_first_live(arena_t* arena_ptr){
+    return block_live_from(arena_ptr, arena_ptr->head);
+}
+
+static inline void* block_next_live(arena_t* arena_ptr, void* ptr){
+    return block_live_from(arena_ptr, tag_next_block(dataptr_to_tag(ptr)));
+}
+
+static void* block_slide_down(arena_t* arena_ptr, void* ptr){
+    // Move the block to the start of the free block before it, if any
+    void*  block = dataptr_to_tag(ptr);
+    size_t tag   = *block_tag(block);
+    if(tag & TAG_PREV_INUSE) return ptr;
+
+    size_t size      = tag_size(tag);
+    void*  prev      = tag_prev_block(block);
+    size_t prev_tag  = *block_tag(prev);
+    size_t free_size = tag_size(prev_tag);
+
+    bin_remove(arena_ptr, (free_gap_t*) prev, free_size);
+
+    // The space left joins the free block after this one
+    void*  next     = tag_next_block(block);
+    size_t next_tag = *block_tag(next);
+
+    if(!(next_tag & TAG_INUSE)){
+        bin_remove(arena_ptr, (free_gap_t*) next, tag_size(next_tag));
+        free_size += tag_size(next_tag);
+    }
+
+    zero_touch(arena_ptr, (uintptr_t) prev, (uintptr_t) prev + size);
+    memmove(tag_to_dataptr(prev), ptr, size - WORDSIZE);
+    *block_tag(prev) = size | TAG_INUSE | (prev_tag & TAG_PREV_INUSE);
+    tag_make_free(arena_ptr, (void*) ((uintptr_t) prev + size), free_size);
+
+    return tag_to_dataptr(prev);
+}
+
+#else
+
+// Block list format
+//
+// Every block starts with an allocator_header_t linking it to the blocks before and
+// after it, free space only exists as gaps between blocks.
+
+// Allocator helper functions
+
+// Largest data size the header can hold
+#define BLOCK_SIZE_MAX ((size_t) (block_size_t) ~(block_size_t) 0 & ~((size_t) ALIGN_SIZE - 1))
+
+// Largest region the links reach
+#if TINYALLOC_LINK_BITS
+#define BLOCK_LINK_MAX   ((size_t) (block_link_t) ~(block_link_t) 0)
+#define BLOCK_REGION_MAX ((BLOCK_LINK_MAX <= SIZE_MAX / ALIGN_SIZE) ? BLOCK_LINK_MAX * ALIGN_SIZE : (size_t) SIZE_MAX)
+#else
+#define BLOCK_REGION_MAX ((size_t) SIZE_MAX)
+#endif
+
+static inline allocator_header_t* link_header(arena_t* arena_ptr, block_link_t link){
+#if TINYALLOC_LINK_BITS
+    return link ? (allocator_header_t*) ((uintptr_t) arena_ptr->start_addr + ((uintptr_t) link - 1) * ALIGN_SIZE) : NULL;
+#else
+    (void) arena_ptr;
+    return (allocator_header_t*) link;
+#endif
+}
+
+static inline block_link_t header_link(arena_t* arena_ptr, allocator_header_t* header_ptr){
+#if TINYALLOC_LINK_BITS
+    return header_ptr ? (block_link_t) (((uintptr_t) header_ptr - (uintptr_t) arena_ptr->start_addr) / ALIGN_SIZE + 1) : 0;
+#else
+    (void) arena_ptr;
+    return (block_link_t) header_ptr;
+#endif
+}
+
+static inline allocator_header_t* header_prev(arena_t* arena_ptr, allocator_header_t* header_ptr){
+    return link_header(arena_ptr, header_ptr->prev);
+}
+
+static inline allocator_header_t* header_next(arena_t* arena_ptr, allocator_header_t* header_ptr){
+    return link_header(arena_ptr, header_ptr->next);
+}
+
+#if TINYALLOC_CANARY
+static inline canary_t compute_canary(arena_t* arena_ptr, allocator_header_t* header_ptr){
+    // The secret of the arena keeps a forged header from matching
+    return (canary_t) header_ptr->size ^ (uintptr_t) header_ptr->prev ^ (uintptr_t) header_ptr->next ^ arena_ptr->canary_secret;
+}
+#endif
+
+static inline void header_seal(arena_t* arena_ptr, allocator_header_t* header_ptr){
+    // Called after every change to the header
+#if TINYALLOC_CANARY
+    header_ptr->canary = compute_canary(arena_ptr, header_ptr);
+#else
+    (void) arena_ptr;
+    (void) header_ptr;
+#endif
+}
+
+static inline void* pointer_end_block(allocator_header_t* header_ptr){
+    // | HEADER | <- header_ptr 
+    // | HEADER |
+    // |  DATA  | <- header_ptr + HEADER_LENGTH
+    // |  DATA  |
+    // |  DATA  |
+    // |  FREE  | <- header_ptr + HEADER_LENGTH + header_ptr->size
+    // |  FREE  |
+    // 
+    // 
+    return (void*) ((uintptr_t) header_ptr + HEADER_LENGHT + header_ptr->size);
+}
+
+static size_t available_block_space(arena_t* arena_ptr, allocator_header_t* header_ptr){
+    if(header_ptr->next){
+        return (size_t) ((uintptr_t) header_next(arena_ptr, header_ptr) - (uintptr_t) pointer_end_block(header_ptr));
+    } else {
+        // End of the linked-list
+        return (size_t) ((uintptr_t) arena_ptr->start_addr + arena_ptr->arena_size) - (uintptr_t) pointer_end_block(header_ptr); 
+    }
+}
+
+
+static inline allocator_header_t* ptr_to_header_ptr(void* ptr){
+    return (allocator_header_t*) ((uintptr_t) ptr - HEADER_LENGHT);
+}
+
+static inline size_t compute_block_size(size_t padded_size){
+    return padded_size + HEADER_LENGHT;
+}
+
+static inline void* header_to_dataptr(allocator_header_t* header_t){
+    return (void*) ((uintptr_t) header_t + HEADER_LENGHT); 
+}
+
+// Gaps of the block list
+
+static inline void* gap_start(arena_t* arena_ptr, allocator_header_t* owner){
+    return owner ? pointer_end_block(owner) : arena_ptr->start_addr;
+}
+
+static inline size_t gap_size(arena_t* arena_ptr, allocator_header_t* owner){
+    if(owner) return available_block_space(arena_ptr, owner);
+
+    if(arena_ptr->head){
+        return (size_t) ((uintptr_t) arena_ptr->head - (uintptr_t) arena_ptr->start_addr);
+    } else {
+        return arena_ptr->arena_size;
+    }
+}
+
+static void gap_index_insert(arena_t* arena_ptr, allocator_header_t* owner){
+    // Called after every change to the end of owner, its whole block is written
+    if(owner) zero_touch(arena_ptr, (uintptr_t) owner, (uintptr_t) pointer_end_block(owner));
+
+    size_t size = gap_size(arena_ptr, owner);
+    if(size < MIN_GAP_SIZE) return;
+
+    free_gap_t* gap = (free_gap_t*) gap_start(arena_ptr, owner);
+
+    gap->size  = size;
+    gap->owner = (void*) owner;
+    bin_insert(arena_ptr, gap, size);
+}
+
+static void gap_index_remove(arena_t* arena_ptr, allocator_header_t* owner){
+    // Must be called before the blocks around the gap are modified
+    size_t size = gap_size(arena_ptr, owner);
+    if(size < MIN_GAP_SIZE) return;
+
+    bin_remove(arena_ptr, (free_gap_t*) gap_start(arena_ptr, owner), size);
+}
+
+static inline size_t block_usable_size(void* ptr){
+    return ptr_to_header_ptr(ptr)->size;
+}
+
+static size_t block_inplace_size(arena_t* arena_ptr, void* ptr){
+    // Biggest size the block can be resized to without moving it
+    allocator_header_t* header_ptr = ptr_to_header_ptr(ptr);
+    size_t size = header_ptr->size + available_block_space(arena_ptr, header_ptr);
+    if(size > BLOCK_SIZE_MAX) size = BLOCK_SIZE_MAX;
+
+    return size & ~((size_t) ALIGN_SIZE - 1);
+}
+
+static void block_format_init(arena_t* arena_ptr){
+    // Headers sit at ALIGN_SIZE boundaries (and links count ALIGN_SIZE units from start_addr),
+    // so start_addr is aligned up. Headers past the last offset a link holds are never placed
+    uintptr_t start = align_up((uintptr_t) arena_ptr->start_addr, ALIGN_SIZE);
+    size_t    skip  = (size_t) (start - (uintptr_t) arena_ptr->start_addr);
+
+    arena_ptr->start_addr = (void*) start;
+    arena_ptr->arena_size = (arena_ptr->arena_size > skip) ? arena_ptr->arena_size - skip : 0;
+    if(arena_ptr->arena_size > BLOCK_REGION_MAX) arena_ptr->arena_size = BLOCK_REGION_MAX;
+
+    // The known zero range only covers the region left
+    if(arena_ptr->zero_start < start) arena_ptr->zero_start = start;
+    if(arena_ptr->zero_end > start + arena_ptr->arena_size) arena_ptr->zero_end = start + arena_ptr->arena_size;
+    if(arena_ptr->zero_end <= arena_ptr->zero_start) arena_ptr->zero_start = arena_ptr->zero_end = 0;
+
+    // The whole arena is a single gap
+    gap_index_insert(arena_ptr, NULL);
+}
+
+static size_t block_tail_gap(arena_t* arena_ptr){
+    // Free bytes after the last block
+    return gap_size(arena_ptr, (allocator_header_t*) arena_ptr->tail);
+}
+
+static inline bool block_arena_empty(arena_t* arena_ptr){
+    return arena_ptr->head == NULL;
+}
+
+
+// Core allocator, the arena must be locked by the caller
+
+static void link_block(arena_t* arena_ptr, allocator_header_t* prev, allocator_header_t* newblock, size_t padded_size){
+    // Insert newblock in the linked list after prev (or as the first block if prev is NULL)
+    stats_block_add(arena_ptr, padded_size + HEADER_LENGHT);
+
+    allocator_header_t* next = prev ? header_next(arena_ptr, prev) : (allocator_header_t*) arena_ptr->head;
+
+    newblock->size = (block_size_t) padded_size;
+    newblock->prev = header_link(arena_ptr, prev);
+    newblock->next = header_link(arena_ptr, next);
+    header_seal(arena_ptr, newblock);
+
+    if(prev){
+        // Update previous block pointer
+        prev->next = header_link(arena_ptr, newblock);
+        // Recompute previous block canary
+        header_seal(arena_ptr, prev);
+    } else {
+        // Allocate a block on the start of the linked list and point arena to it!
+        arena_ptr->head = newblock;
+    }
+
+    if(next){
+        // Update next block prev pointer to this element
+        next->prev = header_link(arena_ptr, newblock);
+        // Recompute next block canary
+        header_seal(arena_ptr, next);
+    } else {
+        // This is the last block in the linked list, update tail pointer
+        arena_ptr->tail = newblock;
+    }
+}
+
+static void* block_malloc(arena_t* arena_ptr, size_t size){
+    // Allocate a free block in the arena. Size 0 is valid
+    size_t padded_size = next_padding_size(size);
+    size_t block_size  = compute_block_size(padded_size);
+
+    // Size overflow
+    if(padded_size < size || padded_size > BLOCK_SIZE_MAX || block_size < padded_size) return NULL;
+
+    free_gap_t* gap = gap_index_find(arena_ptr, block_size);
+
+    // No gap is big enough, out of memory
+    if(!gap) return NULL;
+
+    // The new block goes at the start of the gap, right after its owner
+    allocator_header_t* prev     = (allocator_header_t*) gap->owner;
+    allocator_header_t* newblock = (allocator_header_t*) gap;
+
+    gap_index_remove(arena_ptr, prev);
+    link_block(arena_ptr, prev, newblock, padded_size);
+
+    // Whatever is left of the gap now follows the new block
+    gap_index_insert(arena_ptr, newblock);
+
+    return header_to_dataptr(newblock);
+}
+
+static void* block_memalign(arena_t* arena_ptr, size_t align, size_t size){
+    // Allocate a block whose data is aligned to align (power of two)
+    if(align <= (size_t) ALIGN_SIZE) return block_malloc(arena_ptr, size);
+
+    size_t padded_size = next_padding_size(size);
+    size_t block_size  = compute_block_size(padded_size);
+    size_t search_size = block_size + align - ALIGN_SIZE;
+
+    // Size overflow
+    if(padded_size < size || padded_size > BLOCK_SIZE_MAX || block_size < padded_size || search_size < block_size) return NULL;
+
+    // Any gap this big has room for the block after the alignment padding
+    free_gap_t* gap = gap_index_find(arena_ptr, search_size);
+    if(!gap) return NULL;
+
+    allocator_header_t* prev     = (allocator_header_t*) gap->owner;
+    uintptr_t           data     = align_up((uintptr_t) gap + HEADER_LENGHT, align);
+    allocator_header_t* newblock = ptr_to_header_ptr((void*) data);
+
+    gap_index_remove(arena_ptr, prev);
+    link_block(arena_ptr, prev, newblock, padded_size);
+
+    // The padding before the block stays as a gap of prev
+    gap_index_insert(arena_ptr, prev);
+    gap_index_insert(arena_ptr, newblock);
+
+    return (void*) data;
+}
+
+static inline bool block_verify(arena_t* arena_ptr, void* ptr){
+    // The header of the block and of the neighbours linked to it must match their canaries
+#if TINYALLOC_HARDENED
+    allocator_header_t* header_ptr = ptr_to_header_ptr(ptr);
+    allocator_header_t* prev       = header_prev(arena_ptr, header_ptr);
+    allocator_header_t* next       = header_next(arena_ptr, header_ptr);
+
+    bool valid = header_ptr->canary == compute_canary(arena_ptr, header_ptr);
+
+    if(valid){
+        valid = prev ? (prev->canary == compute_canary(arena_ptr, prev) && header_next(arena_ptr, prev) == header_ptr) : arena_ptr->head == (void*) header_ptr;
+    }
+
+    if(valid){
+        valid = next ? (next->canary == compute_canary(arena_ptr, next) && header_prev(arena_ptr, next) == header_ptr) : arena_ptr->tail == (void*) header_ptr;
+    }
+
+    return valid || corruption_found(arena_ptr, ptr);
+#else
+    (void) arena_ptr;
+    (void) ptr;
+    return true;
+#endif
+}
+
+static void block_free(arena_t* arena_ptr, void* ptr){
+    if(!block_verify(arena_ptr, ptr)) return;
+
+    allocator_header_t* header_ptr = ptr_to_header_ptr(ptr);
+    allocator_header_t* owner_ptr  = header_prev(arena_ptr, header_ptr);
+    allocator_header_t* next_ptr   = header_next(arena_ptr, header_ptr);
+
+    stats_block_remove(arena_ptr, header_ptr->size + HEADER_LENGHT);
+
+    // The gaps on both sides of the block will be merged in a single one
+    gap_index_remove(arena_ptr, owner_ptr);
+    gap_index_remove(arena_ptr, header_ptr);
+
+    // Find next block and relink the linked-list
+    if(owner_ptr){
+        // Previous block exists
+        owner_ptr->next = header_ptr->next;
+        header_seal(arena_ptr, owner_ptr);
+    } else {
+        // First block of the linked list!
+        // FIX: What happens if we free the first block? Fragmentation on the start?
+        // It's probably fixed, lets see 
+
+        arena_ptr->head = (void*) next_ptr;
+    }
+
+    if(next_ptr){
+        next_ptr->prev = header_ptr->prev;
+        header_seal(arena_ptr, next_ptr);
+    } else {
+        // Update tail pointer, freeing last block
+        arena_ptr->tail = (void*) owner_ptr;
+    }
+
+    gap_index_insert(arena_ptr, owner_ptr);
+}
+
+static size_t block_malloc_batch(arena_t* arena_ptr, size_t size, size_t count, void** out){
+    size_t padded_size = next_padding_size(size);
+    size_t block_size  = compute_block_size(padded_size);
+
+    // Size overflow
+    if(padded_size < size || padded_size > BLOCK_SIZE_MAX || block_size < padded_size) return 0;
+
+    size_t done = 0;
+
+    while(done < count){
+        // Look for a gap holding all the remaining blocks, or at least one
+        size_t wanted = count - done;
+        if(wanted > SIZE_MAX / block_size) wanted = SIZE_MAX / block_size;
+
+        free_gap_t* gap = gap_index_find(arena_ptr, wanted * block_size);
+        if(!gap) gap = gap_index_find(arena_ptr, block_size);
+        if(!gap) break;
+
+        allocator_header_t* prev = (allocator_header_t*) gap->owner;
+        allocator_header_t* next = prev ? header_next(arena_ptr, prev) : (allocator_header_t*) arena_ptr->head;
+
+        size_t run = gap->size / block_size;
+        if(run > count - done) run = count - done;
+
+        gap_index_remove(arena_ptr, prev);
+
+        // Carve the run from the start of the gap, linking each block to the one before it
+        allocator_header_t* first = (allocator_header_t*) gap;
+        allocator_header_t* block = first;
+
+        zero_touch(arena_ptr, (uintptr_t) first, (uintptr_t) first + run * block_size);
+
+        for(size_t i = 0; i < run; i++){
+            stats_block_add(arena_ptr, block_size);
+            block->size = (block_size_t) padded_size;
+            block->prev = header_link(arena_ptr, (i == 0) ? prev : (allocator_header_t*) ((uintptr_t) block - block_size));
+            block->next = header_link(arena_ptr, (i + 1 < run) ? (allocator_header_t*) ((uintptr_t) block + block_size) : next);
+            header_seal(arena_ptr, block);
+
+            out[done++] = header_to_dataptr(block);
+            if(i + 1 < run) block = (allocator_header_t*) ((uintptr_t) block + block_size);
+        }
+
+        // Then hook the run in the list
+        if(prev){
+            prev->next = header_link(arena_ptr, first);
+            header_seal(arena_ptr, prev);
+        } else {
+            arena_ptr->head = first;
+        }
+
+        if(next){
+            next->prev = header_link(arena_ptr, block);
+            header_seal(arena_ptr, next);
+        } else {
+            arena_ptr->tail = block;
+        }
+
+        gap_index_insert(arena_ptr, block);
+    }
+
+    return done;
+}
+
+static inline bool block_is_next(arena_t* arena_ptr, void* ptr, void* next_ptr){
+    // True if next_ptr is the block right after ptr
+    return header_next(arena_ptr, ptr_to_header_ptr(ptr)) == ptr_to_header_ptr(next_ptr);
+}
+
+static void block_free_run(arena_t* arena_ptr, void** ptrs, size_t count){
+    // ptrs are consecutive blocks, unlink all of them at once
+    allocator_header_t* first = ptr_to_header_ptr(ptrs[0]);
+    allocator_header_t* last  = ptr_to_header_ptr(ptrs[count - 1]);
+    allocator_header_t* owner = header_prev(arena_ptr, first);
+    allocator_header_t* next  = header_next(arena_ptr, last);
+
+    for(size_t i = 0; i < count; i++){
+        if(!block_verify(arena_ptr, ptrs[i])) return;
+    }
+
+    gap_index_remove(arena_ptr, owner);
+
+    for(size_t i = 0; i < count; i++){
+        allocator_header_t* header_ptr = ptr_to_header_ptr(ptrs[i]);
+
+        stats_block_remove(arena_ptr, header_ptr->size + HEADER_LENGHT);
+        gap_index_remove(arena_ptr, header_ptr);
+    }
+
+    if(owner){
+        owner->next = header_link(arena_ptr, next);
+        header_seal(arena_ptr, owner);
+    } else {
+        arena_ptr->head = (void*) next;
+    }
+
+    if(next){
+        next->prev = header_link(arena_ptr, owner);
+        header_seal(arena_ptr, next);
+    } else {
+        arena_ptr->tail = (void*) owner;
+    }
+
+    gap_index_insert(arena_ptr, owner);
+}
+
+static void* block_realloc(arena_t* arena_ptr, void* ptr, size_t size){
+    if(!ptr) return block_malloc(arena_ptr, size);
+    if(!block_verify(arena_ptr, ptr)) return NULL;
+
+    allocator_header_t* header_ptr = ptr_to_header_ptr(ptr);
+    
+    size_t newsize_padded   = next_padding_size(size);
+    size_t actual_size      = header_ptr->size;
+
+    // Size overflow
+    if(newsize_padded < size || newsize_padded > BLOCK_SIZE_MAX) return NULL;
+
+    if(newsize_padded <= actual_size){
+        // Shrink data! This causes fragmentation!
+        gap_index_remove(arena_ptr, header_ptr);
+        stats_block_resize(arena_ptr, actual_size, newsize_padded);
+        header_ptr->size = (block_size_t) newsize_padded;
+        header_seal(arena_ptr, header_ptr);
+        gap_index_insert(arena_ptr, header_ptr);
+        return header_to_dataptr(header_ptr);
+    } else {
+        // We need more data, first check if available in contiguous region
+        size_t available_to_next = available_block_space(arena_ptr, header_ptr);
+        size_t required          = newsize_padded - actual_size;
+        
+        if(available_to_next >= required){
+            // Nice, we have enough memory, resize block to new size
+            gap_index_remove(arena_ptr, header_ptr);
+            stats_block_resize(arena_ptr, actual_size, newsize_padded);
+            header_ptr->size = (block_size_t) newsize_padded;
+            header_seal(arena_ptr, header_ptr);
+            gap_index_insert(arena_ptr, header_ptr);
+            return header_to_dataptr(header_ptr);
+        }
+
+        // Then if the gap before the block closes the difference, slide the
+        // block down into it instead of searching the whole index
+        allocator_header_t* prev     = header_prev(arena_ptr, header_ptr);
+        allocator_header_t* next     = header_next(arena_ptr, header_ptr);
+        size_t available_to_prev     = gap_size(arena_ptr, prev);
+
+        if(available_to_prev + available_to_next >= required){
+            gap_index_remove(arena_ptr, prev);
+            gap_index_remove(arena_ptr, header_ptr);
+
+            allocator_header_t* moved = (allocator_header_t*) gap_start(arena_ptr, prev);
+
+            zero_touch(arena_ptr, (uintptr_t) moved, (uintptr_t) header_ptr);
+            memmove(moved, header_ptr, HEADER_LENGHT + actual_size);
+
+            stats_block_resize(arena_ptr, actual_size, newsize_padded);
+            moved->size = (block_size_t) newsize_padded;
+            header_seal(arena_ptr, moved);
+
+            if(prev){
+                prev->next = header_link(arena_ptr, moved);
+                header_seal(arena_ptr, prev);
+            } else {
+                arena_ptr->head = moved;
+            }
+
+            if(next){
+                next->prev = header_link(arena_ptr, moved);
+                header_seal(arena_ptr, next);
+            } else {
+                arena_ptr->tail = moved;
+            }
+
+            gap_index_insert(arena_ptr, moved);
+            return header_to_dataptr(moved);
+        } else {
+            // Not enought... Malloc / copy and free block
+            // This creates A LOT of fragmentation
+            // The arena stays locked, so the move is atomic
+            // Padding size will be maintained
+            void* new_block = block_malloc(arena_ptr, newsize_padded);
+
+            if(new_block){
+                memcpy(new_block, ptr, actual_size);
+                block_free(arena_ptr, ptr);
+            }
+
+            return new_block;
+        }
+    }
+}
+
+// Live blocks in address order, for compaction
+
+static inline void* block_first_live(arena_t* arena_ptr){
+    return arena_ptr->head ? header_to_dataptr((allocator_header_t*) arena_ptr->head) : NULL;
+}
+
+static inline void* block_next_live(arena_t* arena_ptr, void* ptr){
+    allocator_header_t* next = header_next(arena_ptr, ptr_to_header_ptr(ptr));
+    return next ? header_to_dataptr(next) : NULL;
+}
+
+static void* block_slide_down(arena_t* arena_ptr, void* ptr){
+    // Move the block to the start of the gap before it, if any
+    allocator_header_t* header_ptr = ptr_to_header_ptr(ptr);
+    allocator_header_t* prev       = header_prev(arena_ptr, header_ptr);
+    allocator_header_t* next       = header_next(arena_ptr, header_ptr);
+
+    if(!gap_size(arena_ptr, prev)) return ptr;
+
+    gap_index_remove(arena_ptr, prev);
+    gap_index_remove(arena_ptr, header_ptr);
+
+    allocator_header_t* moved = (allocator_header_t*) gap_start(arena_ptr, prev);
+
+    zero_touch(arena_ptr, (uintptr_t) moved, (uintptr_t) header_ptr);
+    memmove(moved, header_ptr, HEADER_LENGHT + header_ptr->size);
+
+    header_seal(arena_ptr, moved);
+
+    if(prev){
+        prev->next = header_link(arena_ptr, moved);
+        header_seal(arena_ptr, prev);
+    } else {
+        arena_ptr->head = moved;
+    }
+
+    if(next){
+        next->prev = header_link(arena_ptr, moved);
+        header_seal(arena_ptr, next);
+    } else {
+        arena_ptr->tail = moved;
+    }
+
+    // Both gaps are now after the block
+    gap_index_insert(arena_ptr, moved);
+    return header_to_dataptr(moved);
+}
+
+#endif
+
+static void* block_calloc(arena_t* arena_ptr, size_t align, size_t size){
+    // The bytes known to be zero before the block is placed are not cleared
+    uintptr_t zero_start = arena_ptr->zero_start;
+    uintptr_t zero_end   = arena_ptr->zero_end;
+
+    void* ptr = block_memalign(arena_ptr, align, size);
+    if(ptr) zero_clear(ptr, size, zero_start, zero_end);
+
+    return ptr;
+}
+
+
+// Slab allocator
+//
+// Requests up to SLAB_MAX_SIZE are served from blocks of SLAB_SIZE bytes aligned to
+// SLAB_SIZE and carved in slots of a single size, without header. The arena keeps a
+// bitmap with one bit per SLAB_SIZE page telling which pages are slabs, so the owner
+// slab of a slot is found by rounding its address down. The bit of the page holding a
+// live pointer can't change, so the thread cache can look it up without the lock.
+
+#if TINYALLOC_SLAB
+
+#define SLAB_MAP_BITS (sizeof(size_t) * 8)
+
+typedef struct slab {
+    struct slab* prev;      // Partial slabs list of the size class
+    struct slab* next;
+    void*        free_list; // Freed slots, linked through their first word
+    uintptr_t    bump;      // First slot never handed out
+    size_t       slot_size;
+    size_t       used;
+#if TINYALLOC_HARDENED
+    size_t       live[(SLAB_SIZE / ALIGN_SIZE + SLAB_MAP_BITS - 1) / SLAB_MAP_BITS];  // One bit per slot handed out
+#endif
+} slab_t;
+
+#define SLAB_SLOTS_OFFSET (align_up(sizeof(slab_t), ALIGN_SIZE))
+
+static inline uintptr_t slab_map_origin(arena_t* arena_ptr){
+    return (uintptr_t) arena_ptr->start_addr & ~((uintptr_t) SLAB_SIZE - 1);
+}
+
+static inline size_t slab_map_pages(arena_t* arena_ptr){
+    return (size_t) ((uintptr_t) arena_ptr->start_addr + arena_ptr->arena_size - slab_map_origin(arena_ptr) + SLAB_SIZE - 1) / SLAB_SIZE;
+}
+
+static void slab_map_set(arena_t* arena_ptr, slab_t* slab, bool is_slab){
+    size_t page = ((uintptr_t) slab - slab_map_origin(arena_ptr)) / SLAB_SIZE;
+    size_t bit  = (size_t) 1 << (page % SLAB_MAP_BITS);
+
+    if(is_slab){
+        __atomic_fetch_or(&arena_ptr->slab_map[page / SLAB_MAP_BITS], bit, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&arena_ptr->slab_map[page / SLAB_MAP_BITS], ~bit, __ATOMIC_RELAXED);
+    }
+}
+
+static inline bool slab_is_full(slab_t* slab){
+    return !slab->free_list && slab->bump + slab->slot_size > (uintptr_t) slab + SLAB_SIZE;
+}
+
+static inline size_t slab_slot_index(slab_t* slab, void* slot){
+    return ((uintptr_t) slot - ((uintptr_t) slab + SLAB_SLOTS_OFFSET)) / slab->slot_size;
+}
+
+static inline void slab_slot_mark(slab_t* slab, void* slot, bool live){
+#if TINYALLOC_HARDENED
+    size_t index = slab_slot_index(slab, slot);
+    size_t bit   = (size_t) 1 << (index % SLAB_MAP_BITS);
+
+    if(live){
+        slab->live[index / SLAB_MAP_BITS] |= bit;
+    } else {
+        slab->live[index / SLAB_MAP_BITS] &= ~bit;
+    }
+#else
+    (void) slab;
+    (void) slot;
+    (void) live;
+#endif
+}
+
+static inline bool slab_verify(arena_t* arena_ptr, slab_t* slab, void* ptr){
+    // ptr must be the start of a slot handed out and not freed since
+#if TINYALLOC_HARDENED
+    uintptr_t first = (uintptr_t) slab + SLAB_SLOTS_OFFSET;
+    bool      valid = (uintptr_t) ptr >= first && (uintptr_t) ptr < slab->bump &&
+                      !(((uintptr_t) ptr - first) % slab->slot_size);
+
+    if(valid){
+        size_t index = slab_slot_index(slab, ptr);
+        valid = slab->live[index / SLAB_MAP_BITS] & ((size_t) 1 << (index % SLAB_MAP_BITS));
+    }
+
+    return valid || corruption_found(arena_ptr, ptr);
+#else
+    (void) arena_ptr;
+    (void) slab;
+    (void) ptr;
+    return true;
+#endif
+}
+
+static slab_t* slab_of(arena_t* arena_ptr, void* ptr){
+    if(!arena_ptr->slab_map) return NULL;
+
+    uintptr_t base = (uintptr_t) ptr & ~((uintptr_t) SLAB_SIZE - 1);
+
+    // Slots never start at the slab address
+    if(base == (uintptr_t) ptr || base < slab_map_origin(arena_ptr)) return NULL;
+
+    size_t page = (base - slab_map_origin(arena_ptr)) / SLAB_SIZE;
+    if(page >= slab_map_pages(arena_ptr)) return NULL;
+
+    size_t bits = __atomic_load_n(&arena_ptr->slab_map[page / SLAB_MAP_BITS], __ATOMIC_RELAXED);
+    if(!(bits & ((size_t) 1 << (page % SLAB_MAP_BITS)))) return NULL;
+
+    return (slab_t*) base;
+}
+
+static void slab_list_push(arena_t* arena_ptr, int class_index, slab_t* slab){
+    slab->prev = NULL;
+    slab->next = (slab_t*) arena_ptr->slab_partial[class_index];
+
+    if(slab->next) slab->next->prev = slab;
+    arena_ptr->slab_partial[class_index] = (void*) slab;
+}
+
+static void slab_list_remove(arena_t* arena_ptr, int class_index, slab_t* slab){
+    if(slab->prev){
+        slab->prev->next = slab->next;
+    } else {
+        arena_ptr->slab_partial[class_index] = (void*) slab->next;
+    }
+
+    if(slab->next) slab->next->prev = slab->prev;
+}
+
+static void* slab_malloc(arena_t* arena_ptr, size_t size){
+    int     class_index = size ? (int) (next_padding_size(size) / ALIGN_SIZE) - 1 : 0;
+    slab_t* slab        = (slab_t*) arena_ptr->slab_partial[class_index];
+
+    if(!slab){
+        // New slab, reuse the spare one if there is any
+        if(arena_ptr->slab_spare){
+            slab = (slab_t*) arena_ptr->slab_spare;
+            arena_ptr->slab_spare = NULL;
+        } else {
+            slab = (slab_t*) block_memalign(arena_ptr, SLAB_SIZE, SLAB_SIZE);
+            if(!slab) return NULL;
+        }
+
+        slab_map_set(arena_ptr, slab, true);
+        slab->free_list = NULL;
+        slab->bump      = (uintptr_t) slab + SLAB_SLOTS_OFFSET;
+        slab->slot_size = (size_t) (class_index + 1) * ALIGN_SIZE;
+        slab->used      = 0;
+#if TINYALLOC_HARDENED
+        memset(slab->live, 0, sizeof(slab->live));
+#endif
+
+        slab_list_push(arena_ptr, class_index, slab);
+    }
+
+    void* slot;
+
+    if(slab->free_list){
+        slot = slab->free_list;
+        slab->free_list = *(void**) slot;
+    } else {
+        slot = (void*) slab->bump;
+        slab->bump += slab->slot_size;
+    }
+
+    slab->used++;
+    slab_slot_mark(slab, slot, true);
+
+    // Full slabs leave the partial list until a slot is freed
+    if(slab_is_full(slab)) slab_list_remove(arena_ptr, class_index, slab);
+
+    return slot;
+}
+
+static void slab_free(arena_t* arena_ptr, slab_t* slab, void* ptr){
+    if(!slab_verify(arena_ptr, slab, ptr)) return;
+
+    int  class_index = (int) (slab->slot_size / ALIGN_SIZE) - 1;
+    bool was_full    = slab_is_full(slab);
+
+    slab_slot_mark(slab, ptr, false);
+    *(void**) ptr   = slab->free_list;
+    slab->free_list = ptr;
+    slab->used--;
+
+    if(was_full) slab_list_push(arena_ptr, class_index, slab);
+
+    if(!slab->used){
+        // Empty slab, keep one as spare and give the rest back to the arena
+        slab_list_remove(arena_ptr, class_index, slab);
+        slab_map_set(arena_ptr, slab, false);
+
+        if(!arena_ptr->slab_spare){
+            arena_ptr->slab_spare = (void*) slab;
+        } else {
+            block_free(arena_ptr, (void*) slab);
+        }
+    }
+}
+
+#endif
+
+static void arena_slab_init(arena_t* arena_ptr, const arena_config_t* config){
+#if TINYALLOC_SLAB
+    arena_ptr->slab_map   = NULL;
+    arena_ptr->slab_spare = NULL;
+    memset(arena_ptr->slab_partial, 0, sizeof(arena_ptr->slab_partial));
+
+    if(config && config->slab){
+        // The page bitmap is the first block of the arena
+        size_t map_size = (slab_map_pages(arena_ptr) + SLAB_MAP_BITS - 1) / SLAB_MAP_BITS * sizeof(size_t);
+
+        arena_ptr->slab_map = (size_t*) block_malloc(arena_ptr, map_size);
+        if(arena_ptr->slab_map) memset(arena_ptr->slab_map, 0, map_size);
+    }
+#else
+    (void) arena_ptr;
+    (void) config;
+#endif
+}
+
+
+// Growable arena
+//
+// When the arena region is full, chunks are taken from the page provider and linked in
+// a list. Every chunk starts with a chunk_t holding an unlocked arena_t for the memory
+// after it, its blocks are handled by the block layer like the ones of the region.
+// Chunks emptied by a free are given back, but one empty chunk is kept to avoid thrashing.
+// An index of the chunks sorted by address finds the chunk of a pointer with a binary search.
+
+#if TINYALLOC_GROW
+
+#define CHUNK_ROUND 4096
+
+typedef struct chunk {
+    struct chunk* prev;
+    struct chunk* next;
+    size_t        size;     // Bytes taken from the page provider, including this struct
+    arena_t       arena;
+} chunk_t;
+
+#if defined(_WIN32)
+
+static void* default_page_alloc(void* ctx, size_t size){
+    (void) ctx;
+    return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+static void default_page_release(void* ctx, void* ptr, size_t size){
+    (void) ctx;
+    (void) size;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+}
+
+#elif defined(__unix__) || defined(__APPLE__)
+
+static void* default_page_alloc(void* ctx, size_t size){
+    (void) ctx;
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (ptr == MAP_FAILED) ? NULL : ptr;
+}
+
+static void default_page_release(void* ctx, void* ptr, size_t size){
+    (void) ctx;
+    munmap(ptr, size);
+}
+
+#else
+
+// No default page provider, the user must set one
+#define default_page_alloc   NULL
+#define default_page_release NULL
+
+#endif
+
+static size_t chunk_index_find(arena_t* arena_ptr, uintptr_t addr){
+    // Number of chunks starting at or before addr
+    chunk_t** index = (chunk_t**) arena_ptr->chunk_index;
+    size_t    low   = 0;
+    size_t    high  = arena_ptr->chunk_count;
+
+    while(low < high){
+        size_t middle = low + (high - low) / 2;
+
+        if((uintptr_t) index[middle] <= addr){
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+static bool chunk_index_insert(arena_t* arena_ptr, chunk_t* chunk){
+    if(arena_ptr->chunk_count == arena_ptr->chunk_index_size / sizeof(chunk_t*)){
+        // Full, move it to pages twice as big
+        size_t size = arena_ptr->chunk_index_size ? arena_ptr->chunk_index_size * 2 : CHUNK_ROUND;
+        if(size < arena_ptr->chunk_index_size) return false;
+
+        void* index = arena_ptr->page_provider.alloc(arena_ptr->page_provider.ctx, size);
+        if(!index) return false;
+
+        if(arena_ptr->chunk_index){
+            memcpy(index, arena_ptr->chunk_index, arena_ptr->chunk_count * sizeof(chunk_t*));
+            arena_ptr->page_provider.release(arena_ptr->page_provider.ctx, arena_ptr->chunk_index, arena_ptr->chunk_index_size);
+        }
+
+        arena_ptr->chunk_index      = index;
+        arena_ptr->chunk_index_size = size;
+    }
+
+    chunk_t** index    = (chunk_t**) arena_ptr->chunk_index;
+    size_t    position = chunk_index_find(arena_ptr, (uintptr_t) chunk);
+
+    memmove(index + position + 1, index + position, (arena_ptr->chunk_count - position) * sizeof(chunk_t*));
+    index[position] = chunk;
+    arena_ptr->chunk_count++;
+
+    return true;
+}
+
+static void chunk_index_remove(arena_t* arena_ptr, chunk_t* chunk){
+    chunk_t** index    = (chunk_t**) arena_ptr->chunk_index;
+    size_t    position = chunk_index_find(arena_ptr, (uintptr_t) chunk) - 1;
+
+    arena_ptr->chunk_count--;
+    memmove(index + position, index + position + 1, (arena_ptr->chunk_count - position) * sizeof(chunk_t*));
+
+    if(!arena_ptr->chunk_count){
+        // The last chunk is gone, so are the pages of the index
+        arena_ptr->page_provider.release(arena_ptr->page_provider.ctx, arena_ptr->chunk_index, arena_ptr->chunk_index_size);
+        arena_ptr->chunk_index      = NULL;
+        arena_ptr->chunk_index_size = 0;
+    }
+}
+
+static chunk_t* chunk_of(arena_t* arena_ptr, void* ptr){
+    // Chunk holding ptr, or NULL if it is in the arena region
+    // ptr - 1 is looked up, so a 0 byte block at the end of a region is found too
+    uintptr_t addr = (uintptr_t) ptr - 1;
+
+    if(addr - (uintptr_t) arena_ptr->start_addr < arena_ptr->arena_size) return NULL;
+
+    size_t position = chunk_index_find(arena_ptr, addr);
+    if(!position) return NULL;
+
+    chunk_t* chunk = ((chunk_t**) arena_ptr->chunk_index)[position - 1];
+    return (addr < (uintptr_t) chunk + chunk->size) ? chunk : NULL;
+}
+
+static chunk_t* chunk_create(arena_t* arena_ptr, size_t bytes){
+    // New chunk with at least bytes usable, linked at the start of the list
+    size_t offset = align_up(sizeof(chunk_t), ALIGN_SIZE);
+    size_t size   = offset + bytes;
+
+    if(size < bytes || size > SIZE_MAX - CHUNK_ROUND || bytes > BLOCK_REGION_MAX) return NULL;
+    if(size < arena_ptr->grow_chunk_size) size = arena_ptr->grow_chunk_size;
+    size = align_up(size, CHUNK_ROUND);
+
+    // Don't ask for more than the block format can use (Example: 16 bit links)
+    // and keep the request a multiple of CHUNK_ROUND
+    if(size - offset > BLOCK_REGION_MAX){
+        size = (offset + BLOCK_REGION_MAX) & ~(size_t) (CHUNK_ROUND - 1);
+        if(size < offset + bytes) size = align_up(offset + bytes, CHUNK_ROUND);
+    }
+
+    if(!arena_ptr->page_provider.alloc) return NULL;
+
+    chunk_t* chunk = (chunk_t*) arena_ptr->page_provider.alloc(arena_ptr->page_provider.ctx, size);
+    if(!chunk) return NULL;
+
+    if(!chunk_index_insert(arena_ptr, chunk)){
+        arena_ptr->page_provider.release(arena_ptr->page_provider.ctx, (void*) chunk, size);
+        return NULL;
+    }
+
+    chunk->size = size;
+    chunk->arena.start_addr = (void*) ((uintptr_t) chunk + offset);
+    chunk->arena.arena_size = size - offset;
+
+    arena_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.policy        = arena_ptr->policy;
+    config.prefer_tail   = arena_ptr->prefer_tail;
+    config.zeroed        = arena_ptr->page_provider.zeroed;
+    config.trim_zeroes   = arena_ptr->page_provider.zeroed;
+    config.canary_secret = arena_ptr->canary_secret;
+#if TINYALLOC_HARDENED
+    config.corruption_hooks = arena_ptr->corruption_hooks;
+#endif
+    arena_init_ex(&chunk->arena, &config);
+
+    // Blocks in the chunk are counted in the arena
+    chunk->arena.stats_arena = arena_ptr;
+
+    chunk->prev = NULL;
+    chunk->next = (chunk_t*) arena_ptr->chunks;
+    if(chunk->next) chunk->next->prev = chunk;
+    arena_ptr->chunks = chunk;
+
+    return chunk;
+}
+
+static void chunk_release(arena_t* arena_ptr, chunk_t* chunk){
+    if(chunk->prev){
+        chunk->prev->next = chunk->next;
+    } else {
+        arena_ptr->chunks = chunk->next;
+    }
+
+    if(chunk->next) chunk->next->prev = chunk->prev;
+
+    chunk_index_remove(arena_ptr, chunk);
+    arena_destroy(&chunk->arena);
+    arena_ptr->page_provider.release(arena_ptr->page_provider.ctx, (void*) chunk, chunk->size);
+}
+
+static inline size_t chunk_request_bytes(size_t align, size_t size){
+    // Chunk bytes enough for a block of size bytes aligned to align, 0 on overflow or if no block holds size
+    size_t bytes = size + align + 4 * HEADER_LENGHT;
+    return (bytes < size || size > BLOCK_SIZE_MAX) ? 0 : bytes;
+}
+
+static inline void* chunk_block(chunk_t* chunk, size_t align, size_t size, bool clear){
+    return clear ? block_calloc(&chunk->arena, align, size) : block_memalign(&chunk->arena, align, size);
+}
+
+static void* chunk_malloc(arena_t* arena_ptr, size_t align, size_t size, bool clear){
+    for(chunk_t* chunk = (chunk_t*) arena_ptr->chunks; chunk; chunk = chunk->next){
+        void* ptr = chunk_block(chunk, align, size, clear);
+        if(ptr) return ptr;
+    }
+
+    size_t bytes = chunk_request_bytes(align, size);
+    if(!bytes) return NULL;
+
+    chunk_t* chunk = chunk_create(arena_ptr, bytes);
+    return chunk ? chunk_block(chunk, align, size, clear) : NULL;
+}
+
+static size_t chunk_malloc_batch(arena_t* arena_ptr, size_t size, size_t count, void** out){
+    size_t done = 0;
+
+    for(chunk_t* chunk = (chunk_t*) arena_ptr->chunks; chunk && done < count; chunk = chunk->next){
+        done += block_malloc_batch(&chunk->arena, size, count - done, out + done);
+    }
+
+    while(done < count){
+        // One chunk for all the remaining blocks if the size allows it
+        size_t bytes = chunk_request_bytes(ALIGN_SIZE, size);
+        if(!bytes) break;
+
+        size_t wanted = count - done;
+        if(wanted > SIZE_MAX / bytes) wanted = SIZE_MAX / bytes;
+
+        chunk_t* chunk = chunk_create(arena_ptr, wanted * bytes);
+        if(!chunk) chunk = chunk_create(arena_ptr, bytes);
+        if(!chunk) break;
+
+        done += block_malloc_batch(&chunk->arena, size, count - done, out + done);
+    }
+
+    return done;
+}
+
+static void chunk_trim(arena_t* arena_ptr, chunk_t* chunk){
+    // Give chunk back if it is empty and another empty chunk is kept
+    if(!block_arena_empty(&chunk->arena)) return;
+
+    for(chunk_t* other = (chunk_t*) arena_ptr->chunks; other; other = other->next){
+        if(other != chunk && block_arena_empty(&other->arena)){
+            chunk_release(arena_ptr, chunk);
+            return;
+        }
+    }
+}
+
+#endif
+
+static void arena_grow_init(arena_t* arena_ptr, const arena_config_t* config){
+#if TINYALLOC_GROW
+    arena_ptr->chunks           = NULL;
+    arena_ptr->chunk_index      = NULL;
+    arena_ptr->chunk_count      = 0;
+    arena_ptr->chunk_index_size = 0;
+    arena_ptr->grow             = config && config->grow;
+    arena_ptr->grow_chunk_size  = (config && config->grow_chunk_size) ? config->grow_chunk_size : GROW_CHUNK_SIZE;
+
+    if(config && config->page_provider.alloc){
+        arena_ptr->page_provider = config->page_provider;
+    } else {
+        arena_ptr->page_provider.alloc   = default_page_alloc;
+        arena_ptr->page_provider.release = default_page_release;
+        arena_ptr->page_provider.ctx     = NULL;
+        arena_ptr->page_provider.zeroed  = true;
+    }
+#else
+    (void) arena_ptr;
+    (void) config;
+#endif
+}
+
+static void arena_grow_destroy(arena_t* arena_ptr){
+#if TINYALLOC_GROW
+    while(arena_ptr->chunks) chunk_release(arena_ptr, (chunk_t*) arena_ptr->chunks);
+#else
+    (void) arena_ptr;
+#endif
+}
+
+
+// Page purge
+//
+// The pages fully inside big free gaps are given back to the OS with madvise, the
+// address range stays reserved and the pages read as zero when touched again. The
+// free_gap_t at the start of a gap and the last word (boundary tag footer) are kept.
+
+#if defined(__unix__) || defined(__APPLE__)
+#define TRIM_SUPPORTED 1
+#else
+#define TRIM_SUPPORTED 0
+#endif
+
+#if TRIM_SUPPORTED
+
+static size_t trim_page_size(void){
+    static size_t page_size = 0;
+    if(!page_size) page_size = (size_t) sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+static size_t trim_gap(arena_t* arena_ptr, free_gap_t* gap){
+    uintptr_t page  = (uintptr_t) trim_page_size();
+    uintptr_t start = align_up((uintptr_t) gap + sizeof(free_gap_t), page);
+    uintptr_t end   = ((uintptr_t) gap + gap_node_size(gap) - WORDSIZE) & ~(page - 1);
+
+    if(end <= start) return 0;
+
+#if defined(MADV_DONTNEED)
+    if(madvise((void*) start, (size_t) (end - start), MADV_DONTNEED) != 0) return 0;
+
+    // Shared and file mappings read the old contents back
+    if(arena_ptr->trim_zeroes) zero_add(arena_ptr, start, end);
+    return (size_t) (end - start);
+#else
+    (void) arena_ptr;
+    return 0;
+#endif
+}
+
+static uint64_t trim_now_ms(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+#endif
+
+static size_t block_arena_trim(arena_t* arena_ptr, size_t threshold){
+    // Purge every indexed gap of at least threshold bytes, the arena must be locked
+    size_t purged = 0;
+
+#if TRIM_SUPPORTED
+    int fl_min, sl_min;
+    gap_mapping(threshold < MIN_GAP_SIZE ? MIN_GAP_SIZE : threshold, &fl_min, &sl_min);
+
+    for(int fl = fl_min; fl < (int) FREE_FL_COUNT; fl++){
+        if(!(arena_ptr->free_fl_bitmap & ((size_t) 1 << fl))) continue;
+
+        for(int sl = (fl == fl_min) ? sl_min : 0; sl < FREE_SL_COUNT; sl++){
+            for(free_gap_t* gap = (free_gap_t*) arena_ptr->free_bins[fl][sl]; gap; gap = gap->next){
+                if(gap_node_size(gap) >= threshold) purged += trim_gap(arena_ptr, gap);
+            }
+        }
+    }
+#else
+    (void) arena_ptr;
+    (void) threshold;
+#endif
+    return purged;
+}
+
+static size_t trim_locked(arena_t* arena_ptr, size_t threshold){
+    size_t purged = block_arena_trim(arena_ptr, threshold);
+
+#if TINYALLOC_GROW
+    for(chunk_t* chunk = (chunk_t*) arena_ptr->chunks; chunk; chunk = chunk->next){
+        purged += block_arena_trim(&chunk->arena, threshold);
+    }
+#endif
+    return purged;
+}
+
+static void trim_decay(arena_t* arena_ptr){
+    // Called by a_free with the arena locked, purges at most once every trim_decay_ms
+#if TRIM_SUPPORTED
+    if(!arena_ptr->trim_decay_ms) return;
+
+    uint64_t now = trim_now_ms();
+    if(now - arena_ptr->trim_last_ms < arena_ptr->trim_decay_ms) return;
+
+    arena_ptr->trim_last_ms = now;
+    trim_locked(arena_ptr, arena_ptr->trim_threshold);
+#else
+    (void) arena_ptr;
+#endif
+}
+
+static void arena_trim_init(arena_t* arena_ptr, const arena_config_t* config){
+    arena_ptr->trim_threshold = (config && config->trim_threshold) ? config->trim_threshold : TRIM_THRESHOLD;
+    arena_ptr->trim_decay_ms  = config ? config->trim_decay_ms : 0;
+    arena_ptr->trim_last_ms   = 0;
+    arena_ptr->trim_zeroes    = config && config->trim_zeroes;
+
+#if TRIM_SUPPORTED
+    if(arena_ptr->trim_decay_ms) arena_ptr->trim_last_ms = trim_now_ms();
+#endif
+}
+
+
+// Sampling heap profiler
+//
+// Every thread counts down the bytes it allocates with a_malloc. When the count runs out
+// the allocation is sampled and a new count is drawn from an exponential distribution of
+// mean sample_rate, so on average one allocation is sampled every sample_rate bytes.
+// Sampled blocks get a backtrace in a hash table keyed by pointer, allocated in the arena,
+// and keep the size and placement of any other allocation. Next to the table, a count of the
+// live samples per home slot tells a_free without the lock whether a pointer may be sampled:
+// those skip the thread cache, so their entry is removed when they are freed.
+
+#if TINYALLOC_SAMPLING
+
+typedef struct {
+    void*  ptr;     // NULL for an empty slot
+    size_t size;
+    int    depth;
+    void*  stack[SAMPLE_STACK_DEPTH];
+} sample_t;
+
+static __thread size_t   sample_countdown;
+static __thread uint64_t sample_seed;
+
+static size_t sample_interval(size_t rate){
+    // -ln(u) * rate with u uniform in (0, 1], log2 is approximated linearly between powers of two
+    if(!sample_seed) sample_seed = (uint64_t) (uintptr_t) &sample_seed ^ 0x9E3779B97F4A7C15ull;
+
+    sample_seed ^= sample_seed << 13;
+    sample_seed ^= sample_seed >> 7;
+    sample_seed ^= sample_seed << 17;
+
+    uint64_t q     = (sample_seed >> 38) + 1;     // (0, 2^26]
+    int      exp   = floor_log2((size_t) q);
+    double   log2q = exp + (double) (q - ((uint64_t) 1 << exp)) / (double) ((uint64_t) 1 << exp);
+    double   value = (26.0 - log2q) * 0.6931471805599453 * (double) rate;
+
+    return (value < 1.0) ? 1 : (size_t) value;
+}
+
+static inline bool sample_should(arena_t* arena_ptr, size_t size){
+    // Fast path: one thread local subtraction per a_malloc
+    if(!arena_ptr->sample_table) return false;
+
+    // The first count of a thread is drawn like the others
+    if(!sample_countdown) sample_countdown = sample_interval(arena_ptr->sample_rate);
+
+    if(sample_countdown > size){
+        sample_countdown -= size;
+        return false;
+    }
+
+    sample_countdown = sample_interval(arena_ptr->sample_rate);
+    return true;
+}
+
+static inline size_t sample_hash(arena_t* arena_ptr, void* ptr){
+    uint64_t key = (uint64_t) (uintptr_t) ptr * 0x9E3779B97F4A7C15ull;
+    return (size_t) (key >> 32) & (arena_ptr->sample_capacity - 1);
+}
+
+static void sample_insert(arena_t* arena_ptr, void* ptr, size_t size, void** stack, int depth){
+    // The arena must be locked. The table is kept at most 3/4 full, extra samples are dropped
+    if(arena_ptr->sample_live >= arena_ptr->sample_capacity / 4 * 3){
+        arena_ptr->sample_dropped++;
+        return;
+    }
+
+    sample_t* table = (sample_t*) arena_ptr->sample_table;
+    size_t    i     = sample_hash(arena_ptr, ptr);
+
+    while(table[i].ptr) i = (i + 1) & (arena_ptr->sample_capacity - 1);
+
+    table[i].ptr   = ptr;
+    table[i].size  = size;
+    table[i].depth = depth;
+    memcpy(table[i].stack, stack, (size_t) depth * sizeof(void*));
+
+    arena_ptr->sample_live++;
+
+    uint32_t* home = &arena_ptr->sample_homes[sample_hash(arena_ptr, ptr)];
+    __atomic_store_n(home, *home + 1, __ATOMIC_RELAXED);
+}
+
+static void sample_forget(arena_t* arena_ptr, void* ptr){
+    // Remove the entry of ptr if it was sampled, the arena must be locked
+    if(!arena_ptr->sample_live) return;
+
+    sample_t* table = (sample_t*) arena_ptr->sample_table;
+    size_t    mask  = arena_ptr->sample_capacity - 1;
+    size_t    i     = sample_hash(arena_ptr, ptr);
+
+    while(table[i].ptr != ptr){
+        if(!table[i].ptr) return;
+        i = (i + 1) & mask;
+    }
+
+    // Linear probing: shift back the entries that would not be found past the hole
+    size_t j = i;
+    for(;;){
+        j = (j + 1) & mask;
+        if(!table[j].ptr) break;
+
+        size_t home = sample_hash(arena_ptr, table[j].ptr);
+        bool   stay = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if(stay) continue;
+
+        table[i] = table[j];
+        i = j;
+    }
+
+    table[i].ptr = NULL;
+    arena_ptr->sample_live--;
+
+    uint32_t* home = &arena_ptr->sample_homes[sample_hash(arena_ptr, ptr)];
+    __atomic_store_n(home, *home - 1, __ATOMIC_RELAXED);
+}
+
+static inline bool sample_maybe(arena_t* arena_ptr, void* ptr){
+    // False if ptr is not sampled. Blocks are sampled before a_malloc returns them, so the
+    // thread freeing one always sees its count
+    if(!arena_ptr->sample_homes) return false;
+
+    return __atomic_load_n(&arena_ptr->sample_homes[sample_hash(arena_ptr, ptr)], __ATOMIC_RELAXED) != 0;
+}
+
+static int sample_backtrace(void** stack){
+#if SAMPLE_HAS_BACKTRACE
+    return backtrace(stack, SAMPLE_STACK_DEPTH);
+#else
+    stack[0] = __builtin_return_address(0);
+    return 1;
+#endif
+}
+
+#else
+
+static inline void sample_forget(arena_t* arena_ptr, void* ptr){
+    (void) arena_ptr;
+    (void) ptr;
+}
+
+static inline bool sample_maybe(arena_t* arena_ptr, void* ptr){
+    (void) arena_ptr;
+    (void) ptr;
+    return false;
+}
+
+#endif
+
+static void arena_sample_init(arena_t* arena_ptr, const arena_config_t* config){
+#if TINYALLOC_SAMPLING
+    arena_ptr->sample_table    = NULL;
+    arena_ptr->sample_homes    = NULL;
+    arena_ptr->sample_rate     = config ? config->sample_rate : 0;
+    arena_ptr->sample_capacity = 0;
+    arena_ptr->sample_live     = 0;
+    arena_ptr->sample_dropped  = 0;
+
+    if(arena_ptr->sample_rate){
+        // The table and the home counts are one block of the arena, its size is a power of two
+        size_t capacity = (config->sample_capacity) ? config->sample_capacity : SAMPLE_CAPACITY;
+        size_t rounded  = 4;
+        while(rounded < capacity && rounded <= SIZE_MAX / 2 / (sizeof(sample_t) + sizeof(uint32_t))) rounded <<= 1;
+
+        size_t bytes = rounded * (sizeof(sample_t) + sizeof(uint32_t));
+        arena_ptr->sample_table = block_malloc(arena_ptr, bytes);
+
+        if(arena_ptr->sample_table){
+            memset(arena_ptr->sample_table, 0, bytes);
+            arena_ptr->sample_homes    = (uint32_t*) ((sample_t*) arena_ptr->sample_table + rounded);
+            arena_ptr->sample_capacity = rounded;
+        }
+    }
+#else
+    (void) arena_ptr;
+    (void) config;
+#endif
+}
+
+
+// Trace recorder
+//
+// Compiled in with TINYALLOC_TRACE, otherwise the helpers are empty. Events go to a bounded
+// lock-free ring (a block of the arena) where every slot has a sequence number: a writer
+// claims the next position with a CAS and publishes the slot by bumping its sequence, the
+// drain reads the published slots in order. Events are dropped when the ring is full, the
+// caller never waits. A thread started by arena_trace_start drains the ring to the file.
+
+#if TINYALLOC_TRACE
+
+typedef struct {
+    size_t              seq;    // Position the slot can be written at, plus one once published
+    arena_trace_event_t event;
+} trace_slot_t;
+
+static inline uint64_t trace_now_ns(void){
+#if defined(__unix__) || defined(__APPLE__)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+static void trace_push(arena_t* arena_ptr, void* ptr, void* new_ptr, size_t size){
+    trace_slot_t* ring = (trace_slot_t*) arena_ptr->trace_ring;
+    size_t        mask = arena_ptr->trace_capacity - 1;
+    size_t        pos  = __atomic_load_n(&arena_ptr->trace_head, __ATOMIC_RELAXED);
+    trace_slot_t* slot;
+
+    for(;;){
+        slot = &ring[pos & mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if(seq == pos){
+            if(__atomic_compare_exchange_n(&arena_ptr->trace_head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if((intptr_t) (seq - pos) < 0){
+            // Not drained yet, the ring is full
+            __atomic_fetch_add(&arena_ptr->trace_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&arena_ptr->trace_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->event.time_ns = trace_now_ns();
+    slot->event.ptr     = (uint64_t) (uintptr_t) ptr;
+    slot->event.new_ptr = (uint64_t) (uintptr_t) new_ptr;
+    slot->event.size    = (uint64_t) size;
+
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static size_t trace_drain(arena_t* arena_ptr, FILE* file){
+    // Only one drain at a time, the caller holds trace_draining
+    trace_slot_t* ring  = (trace_slot_t*) arena_ptr->trace_ring;
+    size_t        mask  = arena_ptr->trace_capacity - 1;
+    size_t        count = 0;
+
+    for(;;){
+        size_t        pos  = arena_ptr->trace_tail;
+        trace_slot_t* slot = &ring[pos & mask];
+
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) break;
+
+        if(file) fwrite(&slot->event, sizeof(slot->event), 1, file);
+
+        arena_ptr->trace_tail = pos + 1;
+        __atomic_store_n(&slot->seq, pos + arena_ptr->trace_capacity, __ATOMIC_RELEASE);
+        count++;
+    }
+
+    return count;
+}
+
+#if TINYALLOC_PTHREAD
+
+static void* trace_thread_main(void* arg){
+    arena_t* arena_ptr = (arena_t*) arg;
+    struct timespec wait = { 0, TRACE_DRAIN_MS * 1000000L };
+
+    while(__atomic_load_n(&arena_ptr->trace_active, __ATOMIC_ACQUIRE)){
+        arena_trace_drain(arena_ptr);
+        nanosleep(&wait, NULL);
+    }
+
+    return NULL;
+}
+
+#endif
+
+#endif
+
+static inline void trace_record(arena_t* arena_ptr, void* ptr, void* new_ptr, size_t size){
+    // ptr is 0 for allocations, new_ptr is 0 for frees
+#if TINYALLOC_TRACE
+    if(__atomic_load_n(&arena_ptr->trace_active, __ATOMIC_RELAXED)) trace_push(arena_ptr, ptr, new_ptr, size);
+#else
+    (void) arena_ptr;
+    (void) ptr;
+    (void) new_ptr;
+    (void) size;
+#endif
+}
+
+static void arena_trace_init(arena_t* arena_ptr, const arena_config_t* config){
+#if TINYALLOC_TRACE
+    arena_ptr->trace_ring     = NULL;
+    arena_ptr->trace_capacity = 0;
+    arena_ptr->trace_head     = 0;
+    arena_ptr->trace_tail     = 0;
+    arena_ptr->trace_dropped  = 0;
+    arena_ptr->trace_file     = NULL;
+    arena_ptr->trace_active   = false;
+    arena_ptr->trace_draining = 0;
+
+    if(config && config->trace_capacity){
+        // The ring is a block of the arena, its size is a power of two
+        size_t rounded = 2;
+        while(rounded < config->trace_capacity && rounded <= SIZE_MAX / 2 / sizeof(trace_slot_t)) rounded <<= 1;
+
+        trace_slot_t* ring = (trace_slot_t*) block_malloc(arena_ptr, rounded * sizeof(trace_slot_t));
+
+        if(ring){
+            for(size_t i = 0; i < rounded; i++) ring[i].seq = i;
+
+            arena_ptr->trace_ring     = ring;
+            arena_ptr->trace_capacity = rounded;
+        }
+    }
+#else
+    (void) arena_ptr;
+    (void) config;
+#endif
+}
+
+
+// Routes a request to the slab allocator or the block allocator, the arena must be locked
+
+static size_t usable_size(arena_t* arena_ptr, void* ptr){
+#if TINYALLOC_SLAB
+    slab_t* slab = slab_of(arena_ptr, ptr);
+    if(slab) return slab->slot_size;
+#else
+    (void) arena_ptr;
+#endif
+    return block_usable_size(ptr);
+}
+
+static size_t inplace_size(arena_t* arena_ptr, void* ptr){
+#if TINYALLOC_SLAB
+    slab_t* slab = slab_of(arena_ptr, ptr);
+    if(slab) return slab->slot_size;
+#endif
+#if TINYALLOC_GROW
+    chunk_t* chunk = chunk_of(arena_ptr, ptr);
+    if(chunk) return block_inplace_size(&chunk->arena, ptr);
+#endif
+    return block_inplace_size(arena_ptr, ptr);
+}
+
+static void* route_malloc(arena_t* arena_ptr, size_t size){
+#if TINYALLOC_SLAB
+    if(arena_ptr->slab_map && size <= SLAB_MAX_SIZE){
+        void* ptr = slab_malloc(arena_ptr, size);
+        if(ptr) return ptr;
+        // No room for a new slab, use a regular block
+    }
+#endif
+    void* ptr = block_malloc(arena_ptr, size);
+
+#if TINYALLOC_GROW
+    // The region is full, use the chunks
+    if(!ptr && arena_ptr->grow) ptr = chunk_malloc(arena_ptr, ALIGN_SIZE, size, false);
+#endif
+    return ptr;
+}
+
+static void* route_memalign(arena_t* arena_ptr, size_t align, size_t size){
+    void* ptr = block_memalign(arena_ptr, align, size);
+
+#if TINYALLOC_GROW
+    if(!ptr && arena_ptr->grow) ptr = chunk_malloc(arena_ptr, align, size, false);
+#endif
+    return ptr;
+}
+
+static void* route_calloc(arena_t* arena_ptr, size_t align, size_t size){
+#if TINYALLOC_SLAB
+    if(align <= (size_t) ALIGN_SIZE && arena_ptr->slab_map && size <= SLAB_MAX_SIZE){
+        void* ptr = slab_malloc(arena_ptr, size);
+
+        if(ptr){
+            memset(ptr, 0, size);
+            return ptr;
+        }
+    }
+#endif
+    void* ptr = block_calloc(arena_ptr, align, size);
+
+#if TINYALLOC_GROW
+    if(!ptr && arena_ptr->grow) ptr = chunk_malloc(arena_ptr, align, size, true);
+#endif
+    return ptr;
+}
+
+static void route_free(arena_t* arena_ptr, void* ptr){
+    sample_forget(arena_ptr, ptr);
+
+#if TINYALLOC_SLAB
+    slab_t* slab = slab_of(arena_ptr, ptr);
+
+    if(slab){
+        slab_free(arena_ptr, slab, ptr);
+        return;
+    }
+#endif
+#if TINYALLOC_GROW
+    chunk_t* chunk = chunk_of(arena_ptr, ptr);
+
+    if(chunk){
+        block_free(&chunk->arena, ptr);
+        chunk_trim(arena_ptr, chunk);
+        return;
+    }
+#endif
+    block_free(arena_ptr, ptr);
+}
+
+static size_t route_malloc_batch(arena_t* arena_ptr, size_t size, size_t count, void** out){
+    size_t done = 0;
+
+#if TINYALLOC_SLAB
+    if(arena_ptr->slab_map && size <= SLAB_MAX_SIZE){
+        while(done < count){
+            void* ptr = slab_malloc(arena_ptr, size);
+            if(!ptr) break;
+            out[done++] = ptr;
+        }
+    }
+#endif
+    done += block_malloc_batch(arena_ptr, size, count - done, out + done);
+
+#if TINYALLOC_GROW
+    if(done < count && arena_ptr->grow) done += chunk_malloc_batch(arena_ptr, size, count - done, out + done);
+#endif
+    return done;
+}
+
+static int compare_ptr(const void* a, const void* b){
+    uintptr_t pa = (uintptr_t) *(void* const*) a;
+    uintptr_t pb = (uintptr_t) *(void* const*) b;
+
+    return (pa > pb) - (pa < pb);
+}
+
+static void route_free_batch(arena_t* arena_ptr, void** ptrs, size_t count){
+    // Sorted by address, adjacent blocks are freed together
+    qsort(ptrs, count, sizeof(void*), compare_ptr);
+
+    size_t i = 0;
+    while(i < count){
+        if(!ptrs[i]){
+            i++;
+            continue;
+        }
+
+        sample_forget(arena_ptr, ptrs[i]);
+
+#if TINYALLOC_SLAB
+        slab_t* slab = slab_of(arena_ptr, ptrs[i]);
+
+        if(slab){
+            slab_free(arena_ptr, slab, ptrs[i]);
+            i++;
+            continue;
+        }
+#endif
+        arena_t* region = arena_ptr;
+
+#if TINYALLOC_GROW
+        // Blocks of a run are always in the same chunk
+        chunk_t* chunk = chunk_of(arena_ptr, ptrs[i]);
+        if(chunk) region = &chunk->arena;
+#endif
+        // Slab slots never start a block, so they can't be part of a run
+        size_t run = 1;
+        while(i + run < count && block_is_next(region, ptrs[i + run - 1], ptrs[i + run])) run++;
+
+        block_free_run(region, ptrs + i, run);
+
+#if TINYALLOC_GROW
+        if(chunk) chunk_trim(arena_ptr, chunk);
+#endif
+        i += run;
+    }
+}
+
+static void* route_realloc(arena_t* arena_ptr, void* ptr, size_t size){
+    if(!ptr) return route_malloc(arena_ptr, size);
+
+    // Only the original allocation is sampled
+    sample_forget(arena_ptr, ptr);
+
+#if TINYALLOC_SLAB
+    slab_t* slab = slab_of(arena_ptr, ptr);
+
+    if(slab){
+        if(!slab_verify(arena_ptr, slab, ptr)) return NULL;
+
+        // Slots can't grow, move to a bigger slot or a block
+        if(size <= slab->slot_size) return ptr;
+
+        void* new_ptr = route_malloc(arena_ptr, size);
+
+        if(new_ptr){
+            memcpy(new_ptr, ptr, slab->slot_size);
+            slab_free(arena_ptr, slab, ptr);
+        }
+
+        return new_ptr;
+    }
+#endif
+#if TINYALLOC_GROW
+    if(arena_ptr->chunks || arena_ptr->grow){
+        chunk_t* chunk = chunk_of(arena_ptr, ptr);
+        arena_t* owner = chunk ? &chunk->arena : arena_ptr;
+
+        // A corrupted block is neither copied nor freed
+        if(!block_verify(owner, ptr)) return NULL;
+
+        void* new_ptr = block_realloc(owner, ptr, size);
+        if(new_ptr) return new_ptr;
+
+        // No room where the block is, move it anywhere else (the region or a new chunk)
+        new_ptr = route_malloc(arena_ptr, size);
+
+        if(new_ptr){
+            size_t actual_size = block_usable_size(ptr);
+            memcpy(new_ptr, ptr, actual_size < size ? actual_size : size);
+            route_free(arena_ptr, ptr);
+        }
+
+        return new_ptr;
+    }
+#endif
+    return block_realloc(arena_ptr, ptr, size);
+}
+
+
+// Thread cache
+//
+// Each thread keeps small stacks of free blocks per size class (linked through their
+// first data word) for up to TCACHE_ARENAS arenas. Cached blocks are still allocated
+// for the arena, they are taken from and given back to it in batches under one lock.
+
+#if TINYALLOC_TCACHE
+
+typedef struct {
+    arena_t* arena;
+    unsigned id;
+    void*    bins[TCACHE_CLASS_COUNT];      // stacks of cached blocks data pointers
+    size_t   count[TCACHE_CLASS_COUNT];
+    size_t   allocs;                        // Served from the cache, added to the arena when it is locked
+} tcache_t;
+
+static __thread tcache_t thread_caches[TCACHE_ARENAS];
+
+static unsigned       tcache_next_id = 1;
+static pthread_key_t  tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static inline size_t tcache_class_size(int class_index){
+    return (size_t) (class_index + 1) * ALIGN_SIZE;
+}
+
+static inline void tcache_merge_stats(tcache_t* cache){
+    // The arena must be locked
+    cache->arena->alloc_count += cache->allocs;
+    cache->allocs = 0;
+}
+
+static void tcache_flush_bin(tcache_t* cache, int class_index, size_t count){
+    arena_lock(cache->arena);
+    tcache_merge_stats(cache);
+
+    while(count-- && cache->bins[class_index]){
+        void* ptr = cache->bins[class_index];
+        cache->bins[class_index] = *(void**) ptr;
+        cache->count[class_index]--;
+
+        route_free(cache->arena, ptr);
+    }
+
+    arena_unlock(cache->arena);
+}
+
+static void tcache_release(tcache_t* cache){
+    for(int i = 0; i < TCACHE_CLASS_COUNT; i++){
+        if(cache->count[i]) tcache_flush_bin(cache, i, cache->count[i]);
+    }
+
+    if(cache->allocs){
+        arena_lock(cache->arena);
+        tcache_merge_stats(cache);
+        arena_unlock(cache->arena);
+    }
+
+    cache->arena = NULL;
+}
+
+static void tcache_thread_exit(void* unused){
+    (void) unused;
+
+    for(int i = 0; i < TCACHE_ARENAS; i++){
+        tcache_t* cache = &thread_caches[i];
+        if(!cache->arena) continue;
+
+        // Left by a destroyed arena (see arena_tcache_destroy), its blocks are gone
+        if(cache->id == cache->arena->tcache_id) tcache_release(cache);
+        else memset(cache, 0, sizeof(tcache_t));
+    }
+}
+
+static void tcache_key_create(void){
+    pthread_key_create(&tcache_key, tcache_thread_exit);
+}
+
+static tcache_t* tcache_get(arena_t* arena_ptr, bool create){
+    tcache_t* empty = NULL;
+
+    for(int i = 0; i < TCACHE_ARENAS; i++){
+        tcache_t* cache = &thread_caches[i];
+
+        if(cache->arena == arena_ptr){
+            if(cache->id == arena_ptr->tcache_id) return cache;
+            // Left by a destroyed arena that lived at the same address, its blocks are gone
+            memset(cache, 0, sizeof(tcache_t));
+        }
+
+        if(!cache->arena && !empty) empty = cache;
+    }
+
+    if(!create || !empty) return NULL;
+
+    // Make sure this thread flushes its caches on exit
+    pthread_once(&tcache_key_once, tcache_key_create);
+    pthread_setspecific(tcache_key, (void*) thread_caches);
+
+    memset(empty, 0, sizeof(tcache_t));
+    empty->arena = arena_ptr;
+    empty->id    = arena_ptr->tcache_id;
+
+    return empty;
+}
+
+static void* tcache_malloc(arena_t* arena_ptr, size_t size){
+    tcache_t* cache = tcache_get(arena_ptr, true);
+    if(!cache) return NULL;
+
+    int class_index = size ? (int) (next_padding_size(size) / ALIGN_SIZE) - 1 : 0;
+
+    if(!cache->bins[class_index]){
+        // Refill from the arena, the last block allocated is returned directly
+        size_t class_size = tcache_class_size(class_index);
+        void*  ptr        = NULL;
+
+        arena_lock(arena_ptr);
+        tcache_merge_stats(cache);
+
+        for(size_t i = 0; i < arena_ptr->tcache_batch; i++){
+            if(ptr){
+                *(void**) ptr = cache->bins[class_index];
+                cache->bins[class_index] = ptr;
+                cache->count[class_index]++;
+            }
+
+            ptr = route_malloc(arena_ptr, class_size);
+            if(!ptr) break;
+        }
+        arena_unlock(arena_ptr);
+
+        if(ptr){
+            cache->allocs++;
+            return ptr;
+        }
+
+        if(!cache->bins[class_index]) return NULL;
+    }
+
+    void* ptr = cache->bins[class_index];
+    cache->bins[class_index] = *(void**) ptr;
+    cache->count[class_index]--;
+    cache->allocs++;
+
+    return ptr;
+}
+
+static bool tcache_free(arena_t* arena_ptr, void* ptr, size_t size){
+    // size is the usable size of the block, or the padded size it was requested with
+    if(size < (size_t) ALIGN_SIZE || size > TCACHE_MAX_SIZE) return false;
+
+    tcache_t* cache = tcache_get(arena_ptr, true);
+    if(!cache) return false;
+
+    int class_index = (int) (size / ALIGN_SIZE) - 1;
+
+    *(void**) ptr = cache->bins[class_index];
+    cache->bins[class_index] = ptr;
+    cache->count[class_index]++;
+
+    if(cache->count[class_index] > arena_ptr->tcache_count){
+        // Too many cached blocks, give a batch back to the arena
+        tcache_flush_bin(cache, class_index, arena_ptr->tcache_batch);
+    }
+
+    return true;
+}
+
+void arena_tcache_flush(arena_t* arena_ptr){
+    tcache_t* cache = tcache_get(arena_ptr, false);
+    if(cache) tcache_release(cache);
+}
+
+static void arena_tcache_destroy(arena_t* arena_ptr){
+    arena_tcache_flush(arena_ptr);
+
+    // A new id makes the caches of the other threads stale, they are dropped instead of flushed
+    arena_ptr->tcache_id = __atomic_fetch_add(&tcache_next_id, 1, __ATOMIC_RELAXED);
+}
+
+#else
+
+void arena_tcache_flush(arena_t* arena_ptr){
+    (void) arena_ptr;
+}
+
+static void arena_tcache_destroy(arena_t* arena_ptr){
+    (void) arena_ptr;
+}
+
+#endif
+
+static void arena_tcache_init(arena_t* arena_ptr, const arena_config_t* config){
+    arena_ptr->tcache_count = 0;
+    arena_ptr->tcache_batch = 0;
+    arena_ptr->tcache_id    = 0;
+
+#if TINYALLOC_TCACHE
+    // Hardened arenas have no thread cache, a_free checks every block with the arena locked
+    if(config && config->tcache_count && !TINYALLOC_HARDENED){
+        arena_ptr->tcache_count = config->tcache_count;
+        arena_ptr->tcache_batch = config->tcache_batch ? config->tcache_batch : config->tcache_count / 2;
+
+        if(!arena_ptr->tcache_batch) arena_ptr->tcache_batch = 1;
+        if(arena_ptr->tcache_batch > arena_ptr->tcache_count) arena_ptr->tcache_batch = arena_ptr->tcache_count;
+
+        arena_ptr->tcache_id = __atomic_fetch_add(&tcache_next_id, 1, __ATOMIC_RELAXED);
+    }
+#else
+    (void) config;
+#endif
+}
+
+
+// Handles
+//
+// A handle is an index (plus one) in a table of data pointers allocated in the arena.
+// Handle blocks are regular blocks (never slab slots) with the handle index in their
+// first word, so arena_compact can tell them apart from the blocks of a_malloc: the
+// index must be in range and its table entry must point right after it. Free entries
+// hold the next free index, shifted and tagged with the low bit.
+
+#define HANDLE_FREE_TAG   ((uintptr_t) 1)
+#define HANDLE_FREE_END   (~(uintptr_t) 0)
+#define HANDLE_INDEX_SIZE ((size_t) ALIGN_SIZE)   // Room for the index, the data stays aligned
+
+static void arena_handle_init(arena_t* arena_ptr, const arena_config_t* config){
+    arena_ptr->handle_table    = NULL;
+    arena_ptr->handle_capacity = 0;
+    arena_ptr->handle_free     = HANDLE_FREE_END;
+
+    if(!config || !config->handle_capacity || config->handle_capacity > SIZE_MAX / sizeof(void*)) return;
+
+    // The table is a block of the arena, it is never moved
+    void** table = (void**) block_malloc(arena_ptr, config->handle_capacity * sizeof(void*));
+    if(!table) return;
+
+    for(size_t i = 0; i < config->handle_capacity; i++){
+        uintptr_t next = (i + 1 < config->handle_capacity) ? (uintptr_t) (i + 1) : HANDLE_FREE_END;
+        table[i] = (void*) ((next << 1) | HANDLE_FREE_TAG);
+    }
+
+    arena_ptr->handle_table    = table;
+    arena_ptr->handle_capacity = config->handle_capacity;
+    arena_ptr->handle_free     = 0;
+}
+
+static inline void* handle_get(arena_t* arena_ptr, size_t index){
+    // Read without the lock by a_hptr, compaction updates the entries
+    return __atomic_load_n(&((void**) arena_ptr->handle_table)[index], __ATOMIC_RELAXED);
+}
+
+static inline void handle_set(arena_t* arena_ptr, size_t index, void* ptr){
+    __atomic_store_n(&((void**) arena_ptr->handle_table)[index], ptr, __ATOMIC_RELAXED);
+}
+
+static inline bool handle_valid(arena_t* arena_ptr, arena_handle_t handle){
+    return handle && handle <= arena_ptr->handle_capacity && !((uintptr_t) handle_get(arena_ptr, handle - 1) & HANDLE_FREE_TAG);
+}
+
+static bool handle_owns(arena_t* arena_ptr, void* ptr){
+    // True if the block at ptr belongs to a handle
+    if(block_usable_size(ptr) < HANDLE_INDEX_SIZE) return false;
+
+    size_t index = *(size_t*) ptr;
+    return index < arena_ptr->handle_capacity && handle_get(arena_ptr, index) == (void*) ((uintptr_t) ptr + HANDLE_INDEX_SIZE);
+}
+
+static void* handle_block_malloc(arena_t* arena_ptr, size_t size){
+    // Regular block with room for the handle index
+    if(size + HANDLE_INDEX_SIZE < size) return NULL;
+    return route_memalign(arena_ptr, ALIGN_SIZE, size + HANDLE_INDEX_SIZE);
+}
+
+static size_t compact_region(arena_t* arena_ptr, arena_t* region){
+    // Slide every handle block of the region down to the end of the block before it
+    size_t moved = 0;
+    void*  ptr   = block_first_live(region);
+
+    while(ptr){
+        if(handle_owns(arena_ptr, ptr)){
+            void* new_ptr = block_slide_down(region, ptr);
+
+            if(new_ptr != ptr){
+                handle_set(arena_ptr, *(size_t*) new_ptr, (void*) ((uintptr_t) new_ptr + HANDLE_INDEX_SIZE));
+                moved++;
+            }
+
+            ptr = new_ptr;
+        }
+
+        ptr = block_next_live(region, ptr);
+    }
+
+    return moved;
+}
+
+
+// Remote frees
+//
+// Blocks freed by threads other than the owner are pushed on a lock-free stack, linked
+// through their first data word. Only the owner takes the whole stack at once with one
+// exchange, so there is no ABA problem, and frees it in sorted batches under one lock.
+
+#define REMOTE_DRAIN_BATCH 64
+
+#if TINYALLOC_PTHREAD
+
+static inline void* thread_self(void){
+    // Every thread has its own copy, its address identifies the thread
+    static __thread char thread_marker;
+    return &thread_marker;
+}
+
+static inline void* remote_owner(arena_t* arena_ptr){
+    // Changed by arena_set_owner while other threads may be freeing
+    return __atomic_load_n(&arena_ptr->remote_owner, __ATOMIC_RELAXED);
+}
+
+static bool remote_free_push(arena_t* arena_ptr, void* ptr){
+    void* owner = remote_owner(arena_ptr);
+    if(!owner || owner == thread_self()) return false;
+
+    // Nowhere to store the link
+    if(usable_size(arena_ptr, ptr) < WORDSIZE) return false;
+
+    void* head = __atomic_load_n(&arena_ptr->remote_head, __ATOMIC_RELAXED);
+
+    do {
+        *(void**) ptr = head;
+    } while(!__atomic_compare_exchange_n(&arena_ptr->remote_head, &head, ptr, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return true;
+}
+
+static void remote_drain(arena_t* arena_ptr){
+    if(!__atomic_load_n(&arena_ptr->remote_head, __ATOMIC_RELAXED) || remote_owner(arena_ptr) != thread_self()) return;
+
+    void*  ptr = __atomic_exchange_n(&arena_ptr->remote_head, NULL, __ATOMIC_ACQUIRE);
+    void*  batch[REMOTE_DRAIN_BATCH];
+    size_t count = 0;
+
+    arena_lock(arena_ptr);
+
+    while(ptr){
+        batch[count++] = ptr;
+        ptr = *(void**) ptr;
+
+        if(count == REMOTE_DRAIN_BATCH || !ptr){
+            route_free_batch(arena_ptr, batch, count);
+            count = 0;
+        }
+    }
+
+    trim_decay(arena_ptr);
+    arena_unlock(arena_ptr);
+}
+
+static void arena_remote_init(arena_t* arena_ptr, const arena_config_t* config){
+    arena_ptr->remote_head  = NULL;
+    arena_ptr->remote_owner = (config && config->remote_free) ? thread_self() : NULL;
+}
+
+#else
+
+static inline bool remote_free_push(arena_t* arena_ptr, void* ptr){
+    (void) arena_ptr;
+    (void) ptr;
+    return false;
+}
+
+static inline void remote_drain(arena_t* arena_ptr){
+    (void) arena_ptr;
+}
+
+static void arena_remote_init(arena_t* arena_ptr, const arena_config_t* config){
+    // No thread identity without pthread, every free takes the lock
+    (void) config;
+    arena_ptr->remote_head  = NULL;
+    arena_ptr->remote_owner = NULL;
+}
+
+#endif
+
+
+// arena functions
+
+void arena_init(arena_t* arena_ptr){
+    arena_init_ex(arena_ptr, NULL);
+}
+
+void arena_init_ex(arena_t* arena_ptr, const arena_config_t* config){
+    // A linear arena only keeps its top, the default configuration disables everything else
+    arena_config_t linear_config;
+
+    arena_ptr->linear   = config && config->linear;
+    arena_ptr->bump_top = 0;
+
+    if(arena_ptr->linear){
+        memset(&linear_config, 0, sizeof(linear_config));
+        config = &linear_config;
+    }
+
+    arena_ptr->head = NULL;
+    arena_ptr->tail = NULL;
+
+    arena_ptr->policy = config ? config->policy : ARENA_POLICY_GOOD_FIT;
+    arena_ptr->rover  = 0;
+
+    arena_ptr->prefer_tail = config ? config->prefer_tail : false;
+
+    arena_ptr->free_fl_bitmap = 0;
+    memset(arena_ptr->free_sl_bitmap, 0, sizeof(arena_ptr->free_sl_bitmap));
+    memset(arena_ptr->free_bins, 0, sizeof(arena_ptr->free_bins));
+    arena_ptr->tail_gap  = NULL;
+    arena_ptr->gap_bound = 0;
+
+    arena_ptr->stats_arena         = arena_ptr;
+    arena_ptr->allocated_size      = 0;
+    arena_ptr->allocated_blocks    = 0;
+    arena_ptr->peak_allocated_size = 0;
+    arena_ptr->alloc_count         = 0;
+    arena_ptr->failed_count        = 0;
+
+    arena_harden_init(arena_ptr, config);
+
+#if TINYALLOC_PROFILE
+    memset(&arena_ptr->profile, 0, sizeof(arena_ptr->profile));
+
+    if(config){
+        arena_ptr->profile_hooks = config->profile_hooks;
+    } else {
+        memset(&arena_ptr->profile_hooks, 0, sizeof(arena_ptr->profile_hooks));
+    }
+#endif
+
+    // Nothing is known to be zero in a region filled by the user
+    bool zeroed = config && config->zeroed && !arena_ptr->linear;
+
+    arena_ptr->zero_start = zeroed ? (uintptr_t) arena_ptr->start_addr : 0;
+    arena_ptr->zero_end   = zeroed ? (uintptr_t) arena_ptr->start_addr + arena_ptr->arena_size : 0;
+
+    if(!arena_ptr->linear) block_format_init(arena_ptr);
+
+    arena_lock_init(arena_ptr, config);
+    arena_tcache_init(arena_ptr, config);
+    arena_slab_init(arena_ptr, config);
+    arena_sample_init(arena_ptr, config);
+    arena_trace_init(arena_ptr, config);
+    arena_handle_init(arena_ptr, config);
+    arena_remote_init(arena_ptr, config);
+    arena_grow_init(arena_ptr, config);
+    arena_trim_init(arena_ptr, config);
+}
+
+void arena_destroy(arena_t* arena_ptr){
+    arena_trace_stop(arena_ptr);
+    arena_tcache_destroy(arena_ptr);
+    arena_grow_destroy(arena_ptr);
+
+    arena_ptr->head = NULL;
+    arena_ptr->tail = NULL;
+    arena_ptr->arena_size = 0;
+    arena_ptr->start_addr = (void*) 0;
+    arena_ptr->bump_top   = 0;
+
+    arena_ptr->free_fl_bitmap = 0;
+    memset(arena_ptr->free_sl_bitmap, 0, sizeof(arena_ptr->free_sl_bitmap));
+    memset(arena_ptr->free_bins, 0, sizeof(arena_ptr->free_bins));
+    arena_ptr->tail_gap  = NULL;
+    arena_ptr->gap_bound = 0;
+
+    arena_lock_destroy(arena_ptr);
+}
+
+void arena_fork_prepare(arena_t* arena_ptr){
+    arena_lock(arena_ptr);
+}
+
+void arena_fork_parent(arena_t* arena_ptr){
+    arena_unlock(arena_ptr);
+}
+
+void arena_fork_child(arena_t* arena_ptr){
+    // Only the forking thread is left, the lock it took is set up again
+    switch(arena_ptr->lock_type){
+        case ARENA_LOCK_NONE:
+            break;
+        case ARENA_LOCK_MUTEX:
+#if TINYALLOC_PTHREAD
+            pthread_mutex_init(&arena_ptr->arena_mutex, NULL);
+            break;
+#endif
+            // fall through
+        case ARENA_LOCK_SPIN:
+            arena_ptr->spinlock = 0;
+            break;
+        case ARENA_LOCK_CUSTOM:
+            arena_ptr->lock_hooks.unlock(arena_ptr->lock_hooks.ctx);
+            break;
+    }
+}
+
+size_t arena_compact(arena_t* arena_ptr){
+    if(!arena_ptr->handle_table) return 0;
+
+    arena_lock(arena_ptr);
+
+    size_t moved = compact_region(arena_ptr, arena_ptr);
+
+#if TINYALLOC_GROW
+    // Blocks don't move between regions
+    for(chunk_t* chunk = (chunk_t*) arena_ptr->chunks; chunk; chunk = chunk->next) moved += compact_region(arena_ptr, &chunk->arena);
+#endif
+
+    arena_unlock(arena_ptr);
+
+    return moved;
+}
+
+void arena_set_owner(arena_t* arena_ptr){
+#if TINYALLOC_PTHREAD
+    if(remote_owner(arena_ptr)) __atomic_store_n(&arena_ptr->remote_owner, thread_self(), __ATOMIC_RELAXED);
+#else
+    (void) arena_ptr;
+#endif
+}
+
+arena_mark_t arena_mark(arena_t* arena_ptr){
+    return arena_ptr->bump_top;
+}
+
+void arena_reset_to(arena_t* arena_ptr, arena_mark_t mark){
+    if(mark >= arena_ptr->bump_top) return;
+
+    // The top only goes down here, so this is enough to keep the peak
+    if(arena_ptr->bump_top > arena_ptr->peak_allocated_size) arena_ptr->peak_allocated_size = arena_ptr->bump_top;
+    arena_ptr->bump_top = mark;
+}
+
+void arena_profile_info(arena_t* arena_ptr, arena_profile_t* profile_ptr){
+#if TINYALLOC_PROFILE
+    size_t* counters = (size_t*) &arena_ptr->profile;
+    size_t* out      = (size_t*) profile_ptr;
+
+    for(size_t i = 0; i < sizeof(arena_profile_t) / sizeof(size_t); i++) out[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+#else
+    (void) arena_ptr;
+    memset(profile_ptr, 0, sizeof(arena_profile_t));
+#endif
+}
+
+void arena_profile_reset(arena_t* arena_ptr){
+#if TINYALLOC_PROFILE
+    size_t* counters = (size_t*) &arena_ptr->profile;
+    for(size_t i = 0; i < sizeof(arena_profile_t) / sizeof(size_t); i++) __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+#else
+    (void) arena_ptr;
+#endif
+}
+
+bool arena_sample_dump(arena_t* arena_ptr, FILE* file){
+#if TINYALLOC_SAMPLING
+    if(!arena_ptr->sample_table) return false;
+
+    arena_lock(arena_ptr);
+
+    sample_t* table = (sample_t*) arena_ptr->sample_table;
+    size_t    bytes = 0;
+
+    for(size_t i = 0; i < arena_ptr->sample_capacity; i++){
+        if(table[i].ptr) bytes += table[i].size;
+    }
+
+    // gperftools heap profile, every sample is one object. pprof scales them with the period
+    fprintf(file, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+        arena_ptr->sample_live, bytes, arena_ptr->sample_live, bytes, arena_ptr->sample_rate);
+
+    for(size_t i = 0; i < arena_ptr->sample_capacity; i++){
+        if(!table[i].ptr) continue;
+
+        fprintf(file, "1: %zu [1: %zu] @", table[i].size, table[i].size);
+        for(int k = 0; k < table[i].depth; k++) fprintf(file, " %p", table[i].stack[k]);
+        fprintf(file, "\n");
+    }
+
+    arena_unlock(arena_ptr);
+
+    // Needed by pprof to symbolize the addresses
+    fprintf(file, "\nMAPPED_LIBRARIES:\n");
+
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if(maps){
+        char   buffer[4096];
+        size_t read;
+
+        while((read = fread(buffer, 1, sizeof(buffer), maps)) > 0) fwrite(buffer, 1, read, file);
+        fclose(maps);
+    }
+
+    return true;
+#else
+    (void) arena_ptr;
+    (void) file;
+    return false;
+#endif
+}
+
+bool arena_trace_start(arena_t* arena_ptr, FILE* file){
+#if TINYALLOC_TRACE
+    if(!arena_ptr->trace_ring || !file || arena_ptr->trace_file) return false;
+
+    // The file starts with a header event, every start adds one
+    arena_trace_event_t header;
+    memset(&header, 0, sizeof(header));
+    header.time_ns = TRACE_MAGIC;
+    header.size    = sizeof(arena_trace_event_t);
+
+    if(fwrite(&header, sizeof(header), 1, file) != 1) return false;
+
+    arena_ptr->trace_file = file;
+    __atomic_store_n(&arena_ptr->trace_active, true, __ATOMIC_RELEASE);
+
+#if TINYALLOC_PTHREAD
+    if(pthread_create(&arena_ptr->trace_thread, NULL, trace_thread_main, arena_ptr)){
+        __atomic_store_n(&arena_ptr->trace_active, false, __ATOMIC_RELEASE);
+        arena_ptr->trace_file = NULL;
+        return false;
+    }
+#endif
+
+    return true;
+#else
+    (void) arena_ptr;
+    (void) file;
+    return false;
+#endif
+}
+
+size_t arena_trace_drain(arena_t* arena_ptr){
+#if TINYALLOC_TRACE
+    if(!arena_ptr->trace_ring || __atomic_exchange_n(&arena_ptr->trace_draining, 1, __ATOMIC_ACQUIRE)) return 0;
+
+    size_t count = trace_drain(arena_ptr, arena_ptr->trace_file);
+
+    __atomic_store_n(&arena_ptr->trace_draining, 0, __ATOMIC_RELEASE);
+    return count;
+#else
+    (void) arena_ptr;
+    return 0;
+#endif
+}
+
+size_t arena_trace_stop(arena_t* arena_ptr){
+#if TINYALLOC_TRACE
+    if(!arena_ptr->trace_file) return 0;
+
+    __atomic_store_n(&arena_ptr->trace_active, false, __ATOMIC_RELEASE);
+
+#if TINYALLOC_PTHREAD
+    pthread_join(arena_ptr->trace_thread, NULL);
+#endif
+
+    // Events recorded before the stop are still in the ring
+    while(arena_trace_drain(arena_ptr));
+    fflush(arena_ptr->trace_file);
+    arena_ptr->trace_file = NULL;
+
+    return __atomic_exchange_n(&arena_ptr->trace_dropped, 0, __ATOMIC_RELAXED);
+#else
+    (void) arena_ptr;
+    return 0;
+#endif
+}
+
+size_t arena_trim(arena_t* arena_ptr, size_t threshold){
+    arena_lock(arena_ptr);
+    size_t purged = trim_locked(arena_ptr, threshold);
+    arena_unlock(arena_ptr);
+
+    return purged;
+}
+
+void arena_info(arena_t* arena_ptr, arena_info_t* arena_info_ptr){
+    if(arena_ptr->linear){
+        // Bump allocations are not counted one by one
+        if(arena_ptr->bump_top > arena_ptr->peak_allocated_size) arena_ptr->peak_allocated_size = arena_ptr->bump_top;
+
+        memset(arena_info_ptr, 0, sizeof(*arena_info_ptr));
+        arena_info_ptr->total_size          = arena_ptr->arena_size;
+        arena_info_ptr->used_size           = arena_ptr->bump_top;
+        arena_info_ptr->allocated_size      = arena_ptr->bump_top;
+        arena_info_ptr->largest_gap_size    = arena_ptr->arena_size - arena_ptr->bump_top;
+        arena_info_ptr->peak_allocated_size = arena_ptr->peak_allocated_size;
+        return;
+    }
+
+    arena_lock(arena_ptr);
+
+    // Only the free space after the last block of every region has to be looked up
+    size_t total_size = arena_ptr->arena_size;
+    size_t tail_gaps  = block_tail_gap(arena_ptr);
+    size_t largest    = gap_index_largest(arena_ptr);
+
+#if TINYALLOC_GROW
+    for(chunk_t* chunk = (chunk_t*) arena_ptr->chunks; chunk; chunk = chunk->next){
+        total_size += chunk->arena.arena_size;
+        tail_gaps  += block_tail_gap(&chunk->arena);
+
+        size_t chunk_largest = gap_index_largest(&chunk->arena);
+        if(chunk_largest > largest) largest = chunk_largest;
+    }
+#endif
+
+    arena_info_ptr->total_size          = total_size;
+    arena_info_ptr->used_size           = total_size - tail_gaps;
+    arena_info_ptr->allocated_size      = arena_ptr->allocated_size;
+    arena_info_ptr->fragmentation_bytes = total_size - tail_gaps - arena_ptr->allocated_size;
+    arena_info_ptr->allocated_blocks    = arena_ptr->allocated_blocks;
+    arena_info_ptr->largest_gap_size    = largest;
+
+    arena_info_ptr->peak_allocated_size = arena_ptr->peak_allocated_size;
+    arena_info_ptr->alloc_count         = arena_ptr->alloc_count;
+    arena_info_ptr->failed_count        = arena_ptr->failed_count;
+
+    arena_unlock(arena_ptr);
+}
+
+
+// Allocator functions
+
+#if TINYALLOC_SAMPLING
+
+static void* sample_malloc(arena_t* arena_ptr, size_t size){
+    // Same block as without sampling, only the thread cache is skipped
+    void* stack[SAMPLE_STACK_DEPTH];
+    int   depth = sample_backtrace(stack);
+
+    arena_lock(arena_ptr);
+
+    void* ptr = route_malloc(arena_ptr, size);
+    if(ptr) sample_insert(arena_ptr, ptr, size, stack, depth);
+    stats_request(arena_ptr, ptr);
+
+    arena_unlock(arena_ptr);
+
+    return ptr;
+}
+
+#endif
+
+void* a_malloc(arena_t* arena_ptr, size_t size){
+    void* ptr = NULL;
+
+#if TINYALLOC_SAMPLING
+    if(sample_should(arena_ptr, size)){
+        ptr = sample_malloc(arena_ptr, size);
+        prof_malloc(arena_ptr, ptr, size);
+        if(ptr) trace_record(arena_ptr, NULL, ptr, size);
+        return ptr;
+    }
+#endif
+
+    remote_drain(arena_ptr);
+
+#if TINYALLOC_TCACHE
+    if(arena_ptr->tcache_count && size <= TCACHE_MAX_SIZE) ptr = tcache_malloc(arena_ptr, size);
+#endif
+
+    if(!ptr){
+        arena_lock(arena_ptr);
+        ptr = route_malloc(arena_ptr, size);
+        stats_request(arena_ptr, ptr);
+        arena_unlock(arena_ptr);
+    }
+
+    prof_malloc(arena_ptr, ptr, size);
+    if(ptr) trace_record(arena_ptr, NULL, ptr, size);
+    return ptr;
+}
+
+void* a_aligned_alloc(arena_t* arena_ptr, size_t alignment, size_t size){
+    // Only powers of two are valid alignments
+    if(!alignment || (alignment & (alignment - 1))) return NULL;
+
+    // Word aligned requests are normal allocations (and can use the thread cache)
+    if(alignment <= (size_t) ALIGN_SIZE) return a_malloc(arena_ptr, size);
+
+    arena_lock(arena_ptr);
+    void* ptr = route_memalign(arena_ptr, alignment, size);
+    stats_request(arena_ptr, ptr);
+    arena_unlock(arena_ptr);
+
+    prof_malloc(arena_ptr, ptr, size);
+    if(ptr) trace_record(arena_ptr, NULL, ptr, size);
+    return ptr;
+}
+
+static void* calloc_aligned(arena_t* arena_ptr, size_t align, size_t count, size_t size){
+    // count * size overflows
+    if(size && count > SIZE_MAX / size) return NULL;
+    size *= count;
+
+    void* ptr = NULL;
+
+    remote_drain(arena_ptr);
+
+#if TINYALLOC_TCACHE
+    // Cached blocks are reused memory anyway, clearing them is cheaper than taking the lock
+    if(align <= (size_t) ALIGN_SIZE && arena_ptr->tcache_count && size <= TCACHE_MAX_SIZE){
+        ptr = tcache_malloc(arena_ptr, size);
+        if(ptr) memset(ptr, 0, size);
+    }
+#endif
+
+    if(!ptr){
+        arena_lock(arena_ptr);
+        ptr = route_calloc(arena_ptr, align, size);
+        stats_request(arena_ptr, ptr);
+        arena_unlock(arena_ptr);
+    }
+
+    prof_malloc(arena_ptr, ptr, size);
+    if(ptr) trace_record(arena_ptr, NULL, ptr, size);
+    return ptr;
+}
+
+void* a_calloc(arena_t* arena_ptr, size_t count, size_t size){
+    return calloc_aligned(arena_ptr, ALIGN_SIZE, count, size);
+}
+
+void* a_aligned_calloc(arena_t* arena_ptr, size_t alignment, size_t count, size_t size){
+    // Only powers of two are valid alignments
+    if(!alignment || (alignment & (alignment - 1))) return NULL;
+
+    return calloc_aligned(arena_ptr, alignment, count, size);
+}
+
+void* a_realloc(arena_t* arena_ptr, void* ptr, size_t size){
+    arena_lock(arena_ptr);
+    void* new_ptr = route_realloc(arena_ptr, ptr, size);
+    stats_request(arena_ptr, new_ptr);
+    arena_unlock(arena_ptr);
+
+    prof_realloc(arena_ptr, ptr, new_ptr, size);
+    if(new_ptr) trace_record(arena_ptr, ptr, new_ptr, size);
+    return new_ptr;
+}
+
+size_t a_malloc_batch(arena_t* arena_ptr, size_t size, size_t count, void** out){
+    arena_lock(arena_ptr);
+    size_t done = route_malloc_batch(arena_ptr, size, count, out);
+
+    arena_ptr->alloc_count += done;
+    if(done < count) arena_ptr->failed_count++;
+
+    arena_unlock(arena_ptr);
+
+    for(size_t i = 0; i < done; i++){
+        prof_malloc(arena_ptr, out[i], size);
+        trace_record(arena_ptr, NULL, out[i], size);
+    }
+
+    return done;
+}
+
+void a_free_batch(arena_t* arena_ptr, void** ptrs, size_t count){
+    if(!count) return;
+
+#if TINYALLOC_PROFILE || TINYALLOC_TRACE
+    for(size_t i = 0; i < count; i++){
+        if(!ptrs[i]) continue;
+
+        prof_free(arena_ptr, ptrs[i]);
+        trace_record(arena_ptr, ptrs[i], NULL, 0);
+    }
+#endif
+
+    arena_lock(arena_ptr);
+    route_free_batch(arena_ptr, ptrs, count);
+    arena_unlock(arena_ptr);
+}
+
+void* a_realloc_ex(arena_t* arena_ptr, void* ptr, size_t min_size, size_t preferred_size, size_t* actual_size){
+    if(preferred_size < min_size) preferred_size = min_size;
+
+    arena_lock(arena_ptr);
+
+    void* new_ptr = NULL;
+
+    if(ptr){
+        size_t size     = usable_size(arena_ptr, ptr);
+        size_t capacity = inplace_size(arena_ptr, ptr);
+
+        if(size >= min_size && size <= preferred_size){
+            // Already in range, nothing to do
+            new_ptr = ptr;
+        } else if(capacity >= min_size){
+            // Take as much of the preferred size as fits without moving
+            new_ptr = route_realloc(arena_ptr, ptr, capacity < preferred_size ? capacity : preferred_size);
+        }
+    }
+
+    if(!new_ptr){
+        // Moving anyway, so reserve the preferred size if there is room for it
+        new_ptr = route_realloc(arena_ptr, ptr, preferred_size);
+        if(!new_ptr && preferred_size != min_size) new_ptr = route_realloc(arena_ptr, ptr, min_size);
+    }
+
+    if(actual_size) *actual_size = new_ptr ? usable_size(arena_ptr, new_ptr) : 0;
+    stats_request(arena_ptr, new_ptr);
+
+    arena_unlock(arena_ptr);
+
+    prof_realloc(arena_ptr, ptr, new_ptr, actual_size ? *actual_size : preferred_size);
+    if(new_ptr) trace_record(arena_ptr, ptr, new_ptr, actual_size ? *actual_size : preferred_size);
+    return new_ptr;
+}
+
+size_t a_usable_size(arena_t* arena_ptr, void* ptr){
+    if(!ptr) return 0;
+
+    // Only the block of ptr is read, so no lock is needed
+    return usable_size(arena_ptr, ptr);
+}
+
+static inline void free_block(arena_t* arena_ptr, void* ptr, size_t class_size){
+    // class_size picks the thread cache class, 0 takes it from the slab of a slot or the header of a block
+    prof_free(arena_ptr, ptr);
+    trace_record(arena_ptr, ptr, NULL, 0);
+
+#if TINYALLOC_TCACHE
+    // Sampled blocks skip the cache, so their sample is removed when they are freed
+    if(arena_ptr->tcache_count && !sample_maybe(arena_ptr, ptr)){
+        if(!class_size) class_size = usable_size(arena_ptr, ptr);
+        if(tcache_free(arena_ptr, ptr, class_size)) return;
+    }
+#else
+    (void) class_size;
+#endif
+
+    if(remote_free_push(arena_ptr, ptr)) return;
+
+    arena_lock(arena_ptr);
+    route_free(arena_ptr, ptr);
+    trim_decay(arena_ptr);
+    arena_unlock(arena_ptr);
+}
+
+void a_free(arena_t* arena_ptr, void* ptr){
+    if(!ptr) return; // Avoid NULL pointers? Will this be needed?
+
+    free_block(arena_ptr, ptr, 0);
+}
+
+void a_free_sized(arena_t* arena_ptr, void* ptr, size_t size){
+    if(!ptr) return;
+
+#if TINYALLOC_HARDENED
+    // The block must hold at least the size given
+    if(size > usable_size(arena_ptr, ptr) && !corruption_found(arena_ptr, ptr)) return;
+#endif
+
+    // The padded size is the class of the request, never bigger than the block: it is cached
+    // without reading the slab or the header. Past TCACHE_MAX_SIZE it goes to the arena as usual
+    free_block(arena_ptr, ptr, next_padding_size(size));
+}
+
+
+arena_handle_t a_halloc(arena_t* arena_ptr, size_t size){
+    if(!arena_ptr->handle_table) return 0;
+
+    arena_lock(arena_ptr);
+
+    arena_handle_t handle = 0;
+    void*          ptr    = NULL;
+
+    if(arena_ptr->handle_free != HANDLE_FREE_END) ptr = handle_block_malloc(arena_ptr, size);
+
+    if(ptr){
+        size_t index = arena_ptr->handle_free;
+        arena_ptr->handle_free = (size_t) ((uintptr_t) handle_get(arena_ptr, index) >> 1);
+
+        *(size_t*) ptr = index;
+        handle_set(arena_ptr, index, (void*) ((uintptr_t) ptr + HANDLE_INDEX_SIZE));
+        handle = index + 1;
+    }
+
+    stats_request(arena_ptr, ptr);
+    arena_unlock(arena_ptr);
+
+    return handle;
+}
+
+void* a_hptr(arena_t* arena_ptr, arena_handle_t handle){
+    if(!handle_valid(arena_ptr, handle)) return NULL;
+    return handle_get(arena_ptr, handle - 1);
+}
+
+bool a_hrealloc(arena_t* arena_ptr, arena_handle_t handle, size_t size){
+    if(size + HANDLE_INDEX_SIZE < size) return false;
+
+    arena_lock(arena_ptr);
+
+    if(!handle_valid(arena_ptr, handle)){
+        arena_unlock(arena_ptr);
+        return false;
+    }
+
+    void* ptr     = (void*) ((uintptr_t) handle_get(arena_ptr, handle - 1) - HANDLE_INDEX_SIZE);
+    void* new_ptr = NULL;
+
+    if(size + HANDLE_INDEX_SIZE <= inplace_size(arena_ptr, ptr)){
+        // Resized in place, it stays a regular block
+        new_ptr = route_realloc(arena_ptr, ptr, size + HANDLE_INDEX_SIZE);
+    } else {
+        new_ptr = handle_block_malloc(arena_ptr, size);
+
+        if(new_ptr){
+            size_t actual_size = block_usable_size(ptr);
+            memcpy(new_ptr, ptr, actual_size < size + HANDLE_INDEX_SIZE ? actual_size : size + HANDLE_INDEX_SIZE);
+            route_free(arena_ptr, ptr);
+        }
+    }
+
+    if(new_ptr) handle_set(arena_ptr, handle - 1, (void*) ((uintptr_t) new_ptr + HANDLE_INDEX_SIZE));
+    stats_request(arena_ptr, new_ptr);
+
+    arena_unlock(arena_ptr);
+
+    return new_ptr != NULL;
+}
+
+void a_hfree(arena_t* arena_ptr, arena_handle_t handle){
+    arena_lock(arena_ptr);
+
+    if(handle_valid(arena_ptr, handle)){
+        size_t index = handle - 1;
+        void*  ptr   = (void*) ((uintptr_t) handle_get(arena_ptr, index) - HANDLE_INDEX_SIZE);
+
+        handle_set(arena_ptr, index, (void*) (((uintptr_t) arena_ptr->handle_free << 1) | HANDLE_FREE_TAG));
+        arena_ptr->handle_free = index;
+
+        route_free(arena_ptr, ptr);
+    }
+
+    arena_unlock(arena_ptr);
+}
+
+static void* bump_alloc(arena_t* arena_ptr, size_t align, size_t size){
+    uintptr_t start  = (uintptr_t) arena_ptr->start_addr;
+    uintptr_t top    = start + arena_ptr->bump_top;
+    uintptr_t data   = align_up(top, align);
+    size_t    padded = next_padding_size(size);
+
+    if(data < top || padded < size) return NULL;
+
+    size_t offset = (size_t) (data - start);
+    if(offset > arena_ptr->arena_size || padded > arena_ptr->arena_size - offset) return NULL;
+
+    arena_ptr->bump_top = offset + padded;
+
+    return (void*) data;
+}
+
+void* a_bump_alloc(arena_t* arena_ptr, size_t size){
+    return bump_alloc(arena_ptr, ALIGN_SIZE, size);
+}
+
+void* a_bump_aligned_alloc(arena_t* arena_ptr, size_t alignment, size_t size){
+    // Only powers of two are valid alignments
+    if(!alignment || (alignment & (alignment - 1))) return NULL;
+
+    return bump_alloc(arena_ptr, alignment < (size_t) ALIGN_SIZE ? (size_t) ALIGN_SIZE : alignment, size);
+}
+
+
+// arena pool
+//
+// The shards are the same size and contiguous, so the owner of a pointer is found
+// with a division. Every shard keeps its own arena, block list and lock.
+
+#define POOL_SHARD_ALIGN 64
+
+static size_t online_cpus(void){
+#if defined(_SC_NPROCESSORS_ONLN)
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus > 0) return (size_t) cpus;
+#endif
+    return 1;
+}
+
+bool arena_pool_init(arena_pool_t* pool_ptr, const arena_config_t* config){
+    arena_config_t shard_config;
+
+    if(config){
+        shard_config = *config;
+#if TINYALLOC_GROW
+        // Owners are found from the shard layout, memory outside the region can't be used
+        shard_config.grow = false;
+#endif
+        shard_config.linear      = false;
+        shard_config.remote_free = false;
+    } else {
+        memset(&shard_config, 0, sizeof(shard_config));
+        shard_config.lock = ARENA_LOCK_MUTEX;
+    }
+
+    if(!pool_ptr->shard_count) pool_ptr->shard_count = online_cpus();
+
+    uintptr_t pool_end     = (uintptr_t) pool_ptr->start_addr + pool_ptr->pool_size;
+    uintptr_t shards_start = align_up(align_up((uintptr_t) pool_ptr->start_addr, sizeof(void*)) + pool_ptr->shard_count * sizeof(arena_t), POOL_SHARD_ALIGN);
+
+    if(shards_start >= pool_end) return false;
+
+    size_t shard_size = ((pool_end - shards_start) / pool_ptr->shard_count) & ~((size_t) POOL_SHARD_ALIGN - 1);
+    if(shard_size < HEADER_LENGHT) return false;
+
+    pool_ptr->shards       = (arena_t*) align_up((uintptr_t) pool_ptr->start_addr, sizeof(void*));
+    pool_ptr->shards_start = (void*) shards_start;
+    pool_ptr->shard_size   = shard_size;
+
+    for(size_t i = 0; i < pool_ptr->shard_count; i++){
+        arena_t* shard = &pool_ptr->shards[i];
+
+        shard->start_addr = (void*) (shards_start + i * shard_size);
+        shard->arena_size = shard_size;
+        arena_init_ex(shard, &shard_config);
+    }
+
+    return true;
+}
+
+void arena_pool_destroy(arena_pool_t* pool_ptr){
+    for(size_t i = 0; i < pool_ptr->shard_count; i++){
+        arena_destroy(&pool_ptr->shards[i]);
+    }
+
+    pool_ptr->shards       = NULL;
+    pool_ptr->shards_start = NULL;
+    pool_ptr->shard_size   = 0;
+}
+
+arena_t* arena_pool_select(arena_pool_t* pool_ptr){
+    size_t index = 0;
+
+#if defined(__linux__)
+    int cpu = sched_getcpu();
+
+    if(cpu >= 0){
+        index = (size_t) cpu;
+    } else
+#endif
+    {
+#if TINYALLOC_PTHREAD
+        uintptr_t hash = (uintptr_t) thread_self();
+
+        hash ^= hash >> 17;
+        hash *= (uintptr_t) 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+        index = (size_t) hash;
+#endif
+    }
+
+    return &pool_ptr->shards[index % pool_ptr->shard_count];
+}
+
+arena_t* arena_pool_owner(arena_pool_t* pool_ptr, void* ptr){
+    // A 0 bytes block at the end of a shard has its data pointer at the start of the next one,
+    // so look for the byte before it, which is always in the block
+    uintptr_t addr   = (uintptr_t) ptr - 1;
+    uintptr_t offset = addr - (uintptr_t) pool_ptr->shards_start;
+
+    if(addr < (uintptr_t) pool_ptr->shards_start) return NULL;
+    if(offset >= pool_ptr->shard_size * pool_ptr->shard_count) return NULL;
+
+    return &pool_ptr->shards[offset / pool_ptr->shard_size];
+}
+
+static arena_t* pool_owner_checked(arena_pool_t* pool_ptr, void* ptr){
+    // NULL for a pointer outside of the pool, reported as corrupted when hardened.
+    // Every shard has the same hooks, the first one reports it
+    arena_t* owner = arena_pool_owner(pool_ptr, ptr);
+
+#if TINYALLOC_HARDENED
+    if(!owner && pool_ptr->shard_count) corruption_found(&pool_ptr->shards[0], ptr);
+#endif
+
+    return owner;
+}
+
+static void pool_forget_failure(arena_t* shard){
+    // The shard refused a request that another one (or the selected one) accounts for
+    arena_lock(shard);
+    shard->failed_count--;
+    arena_unlock(shard);
+}
+
+static void* pool_spill_malloc(arena_pool_t* pool_ptr, arena_t* first, size_t size){
+    // first refused size and counted the failure, which stays only if every shard refuses
+    for(size_t i = 0; i < pool_ptr->shard_count; i++){
+        arena_t* shard = &pool_ptr->shards[i];
+        if(shard == first) continue;
+
+        void* ptr = a_malloc(shard, size);
+
+        if(ptr){
+            pool_forget_failure(first);
+            return ptr;
+        }
+
+        pool_forget_failure(shard);
+    }
+
+    return NULL;
+}
+
+void* a_pool_malloc(arena_pool_t* pool_ptr, size_t size){
+    arena_t* first = arena_pool_select(pool_ptr);
+    void*    ptr   = a_malloc(first, size);
+
+    if(ptr) return ptr;
+
+    // Selected shard is full, spill to the other ones
+    return pool_spill_malloc(pool_ptr, first, size);
+}
+
+void* a_pool_realloc(arena_pool_t* pool_ptr, void* ptr, size_t size){
+    if(!ptr) return a_pool_malloc(pool_ptr, size);
+
+    arena_t* owner = pool_owner_checked(pool_ptr, ptr);
+    if(!owner) return NULL;
+
+    void* new_ptr = a_realloc(owner, ptr, size);
+
+    if(new_ptr) return new_ptr;
+
+    // The owner shard is full, move the block to another shard
+    new_ptr = pool_spill_malloc(pool_ptr, owner, size);
+
+    if(new_ptr){
+        arena_lock(owner);
+        size_t actual_size = usable_size(owner, ptr);
+        arena_unlock(owner);
+
+        memcpy(new_ptr, ptr, actual_size < size ? actual_size : size);
+        a_free(owner, ptr);
+    }
+
+    return new_ptr;
+}
+
+void a_pool_free(arena_pool_t* pool_ptr, void* ptr){
+    if(!ptr) return;
+
+    arena_t* owner = pool_owner_checked(pool_ptr, ptr);
+    if(!owner) return;
+
+    a_free(owner, ptr);
+}
@@ -13,32 +13,349 @@
 #ifndef _TINYALLOC_INCLUDED
 #define _TINYALLOC_INCLUDED
 
-// debug
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 
+#include "tinyalloc_config.h"
+
+// Thread support, pthread is used by default on POSIX systems
+#ifndef TINYALLOC_PTHREAD
+#if defined(__unix__) || defined(__APPLE__)
+#define TINYALLOC_PTHREAD 1
+#else
+#define TINYALLOC_PTHREAD 0
+#endif
+#endif
+
+#if TINYALLOC_PTHREAD
+#include <pthread.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Thread caches in front of the arenas, they need pthread to be flushed on thread exit
+#ifndef TINYALLOC_TCACHE
+#define TINYALLOC_TCACHE TINYALLOC_PTHREAD
+#endif
+
+// Block format: boundary tags (one word per live block, size and in-use bits, footer on free
+// blocks) instead of the doubly-linked list of allocator_header_t
+#ifndef TINYALLOC_BOUNDARY_TAGS
+#define TINYALLOC_BOUNDARY_TAGS 0
+#endif
+
+// Slab allocator for small sizes
+#ifndef TINYALLOC_SLAB
+#define TINYALLOC_SLAB 1
+#endif
+
+// Growable arenas: chunks from a page provider when the arena region is full
+#ifndef TINYALLOC_GROW
+#define TINYALLOC_GROW 1
+#endif
+
+// Instrumentation: size and walk histograms, realloc counters and malloc / free hooks per arena
+#ifndef TINYALLOC_PROFILE
+#define TINYALLOC_PROFILE 0
+#endif
+
+// Sampling heap profiler: backtraces of about one a_malloc every sample_rate bytes
+#ifndef TINYALLOC_SAMPLING
+#define TINYALLOC_SAMPLING 0
+#endif
+
+// Trace recorder: a_malloc, a_realloc and a_free events written to a file through a lock-free ring
+#ifndef TINYALLOC_TRACE
+#define TINYALLOC_TRACE 0
+#endif
+
+// Hardened mode: headers are checked in free, realloc and the free gap walk, corrupted
+// blocks are reported to the corruption handler of the arena
+#ifndef TINYALLOC_HARDENED
+#define TINYALLOC_HARDENED 0
+#endif
+
+#if TINYALLOC_HARDENED && !TINYALLOC_CANARY && !TINYALLOC_BOUNDARY_TAGS
+#error "TINYALLOC_HARDENED needs TINYALLOC_CANARY"
+#endif
+
 #define WORDSIZE    (sizeof(void*))
-#define ALIGN_SIZE  ((int) (WORDSIZE))
-// TODO: 4*WORDSIZE to use only 16 bytes on 32 bit systems
-// #define HEADER_LENGHT 32
-// DONE: 4*WORDSIZE!
-#define HEADER_LENGHT (4 * WORDSIZE)
+#define ALIGN_SIZE  ((int) (TINYALLOC_MIN_ALIGN))
+// Block list format header, sizeof(allocator_header_t) rounded up to ALIGN_SIZE (4 words by default,
+// see tinyalloc_config.h). Boundary tags only use one word per block
+#define HEADER_LENGHT ((sizeof(allocator_header_t) + (ALIGN_SIZE - 1)) & ~(size_t) (ALIGN_SIZE - 1))
+
+
+// Free gap index: one first level per power of two (gap sizes in [2^n, 2^(n+1))),
+// split linearly in FREE_SL_COUNT second level bins
+#define FREE_FL_COUNT  (sizeof(size_t) * 8)
+#define FREE_SL_LOG2   3
+#define FREE_SL_COUNT  (1 << FREE_SL_LOG2)
+
+// Thread cache: one size class per ALIGN_SIZE bytes up to TCACHE_MAX_SIZE, for TCACHE_ARENAS arenas per thread
+#define TCACHE_CLASS_COUNT 16
+#define TCACHE_MAX_SIZE    (TCACHE_CLASS_COUNT * (size_t) ALIGN_SIZE)
+#define TCACHE_ARENAS      4
+
+// Slab allocator: one size class per ALIGN_SIZE bytes up to SLAB_MAX_SIZE, slabs of SLAB_SIZE (power of two) bytes
+#define SLAB_SIZE          4096
+#define SLAB_CLASS_COUNT   8
+#define SLAB_MAX_SIZE      (SLAB_CLASS_COUNT * (size_t) ALIGN_SIZE)
+
+// Growable arenas: default minimum size of the chunks asked to the page provider
+#define GROW_CHUNK_SIZE    (1024 * 1024)
+
+// Page purge: default smallest gap purged by the decay timer
+#define TRIM_THRESHOLD     (64 * 1024)
+
+// Instrumentation: log2 buckets, bucket n counts values in [2^(n-1), 2^n) and bucket 0 the zeros
+#define PROF_SIZE_BUCKETS  (sizeof(size_t) * 8 + 1)
+#define PROF_WALK_BUCKETS  16
+
+// Sampling heap profiler: default side table entries and frames kept per sample
+#define SAMPLE_CAPACITY    1024
+#define SAMPLE_STACK_DEPTH 16
+
+// Trace recorder: milliseconds between drains of the ring, and value of the time_ns field of the
+// header event starting every recording ("TATRACE1" in little endian)
+#define TRACE_DRAIN_MS     10
+#define TRACE_MAGIC        0x3145434152544154ull
 
 
-typedef uint8_t ALIGN[HEADER_LENGHT];
 typedef size_t canary_t;
 
+// Fields of allocator_header_t, their width is set in tinyalloc_config.h
+#if TINYALLOC_LINK_BITS == 16
+typedef uint16_t block_link_t;  // Offset from the start of the arena in ALIGN_SIZE units plus one, 0 for none
+#elif TINYALLOC_LINK_BITS == 32
+typedef uint32_t block_link_t;
+#else
+typedef void*    block_link_t;
+#endif
+
+#if TINYALLOC_SIZE_BITS == 16
+typedef uint16_t block_size_t;
+#elif TINYALLOC_SIZE_BITS == 32
+typedef uint32_t block_size_t;
+#else
+typedef size_t   block_size_t;
+#endif
+
+// Allocation policies
+typedef enum {
+    ARENA_POLICY_GOOD_FIT = 0,  // First fit inside the size class of the request, then any bigger class
+    ARENA_POLICY_TLSF,          // Two-Level Segregated Fit, constant time malloc and free
+    ARENA_POLICY_BEST_FIT,      // Smallest gap that fits
+    ARENA_POLICY_FIRST_FIT,     // Address ordered first fit: lowest gap that fits
+    ARENA_POLICY_NEXT_FIT       // Lowest gap that fits after the last block placed, wrapping around
+} arena_policy_t;
+
+// Lock backends
+typedef enum {
+    ARENA_LOCK_NONE = 0,    // No locking, single threaded usage
+    ARENA_LOCK_MUTEX,       // pthread mutex (the spinlock is used if TINYALLOC_PTHREAD is 0)
+    ARENA_LOCK_SPIN,        // Test and test-and-set spinlock with exponential backoff
+    ARENA_LOCK_CUSTOM       // User supplied primitives in arena_lock_hooks_t (RTOS mutex, IRQ masking...)
+} arena_lock_type_t;
+
+// User supplied lock primitives, init and destroy are optional
+typedef struct {
+    void (*init)(void* ctx);
+    void (*lock)(void* ctx);
+    void (*unlock)(void* ctx);
+    void (*destroy)(void* ctx);
+    void* ctx;
+} arena_lock_hooks_t;
+
+// User supplied page provider for growable arenas, alloc returns NULL on error
+typedef struct {
+    void* (*alloc)(void* ctx, size_t size);
+    void  (*release)(void* ctx, void* ptr, size_t size);
+    void* ctx;
+    bool  zeroed;   // alloc returns zero filled pages that read as zero again when purged (Example: mmap), a_calloc doesn't clear them
+} arena_page_provider_t;
+
+// User supplied instrumentation hooks (Example: sampling profilers), called with the arena unlocked
+typedef struct {
+    void (*on_malloc)(void* ctx, void* ptr, size_t size);
+    void (*on_free)(void* ctx, void* ptr);
+    void* ctx;
+} arena_profile_hooks_t;
+
+// Trace recorder event, written to the file as is (host byte order). Allocations have ptr 0,
+// frees have new_ptr 0 and reallocations both. The pointers are only used to pair the events
+typedef struct {
+    uint64_t time_ns;   // CLOCK_MONOTONIC, TRACE_MAGIC for the header event
+    uint64_t ptr;       // Block freed or reallocated
+    uint64_t new_ptr;   // Block returned
+    uint64_t size;      // Requested size, sizeof(arena_trace_event_t) for the header event
+} arena_trace_event_t;
+
+// Hardened mode: called with the arena locked when a corrupted block is found
+typedef struct {
+    void (*on_corruption)(void* ctx, void* ptr);    // NULL prints the address and calls abort()
+    void* ctx;
+} arena_corruption_hooks_t;
+
+// Instrumentation counters, only updated with TINYALLOC_PROFILE
+typedef struct {
+    size_t size_histogram[PROF_SIZE_BUCKETS];   // Allocation requests per log2 size
+    size_t walk_histogram[PROF_WALK_BUCKETS];   // Gaps visited per free index lookup, log2 buckets (the last one is open)
+    size_t realloc_inplace;                     // Reallocations that kept the pointer
+    size_t realloc_moved;                       // Reallocations that moved the block
+} arena_profile_t;
+
+// arena configuration, zero initialized means defaults
+typedef struct {
+    arena_policy_t     policy;
+    arena_lock_type_t  lock;
+    arena_lock_hooks_t lock_hooks;  // Only for ARENA_LOCK_CUSTOM
+
+    bool   prefer_tail;     // Append after the last block while there is room, before reusing the gaps
+    bool   zeroed;          // The region is zero filled (Example: static storage), a_calloc doesn't clear its untouched part
+
+    size_t tcache_count;    // Blocks cached per size class and thread, 0 disables the thread cache. Ignored with TINYALLOC_HARDENED
+    size_t tcache_batch;    // Blocks moved from / to the arena at once, 0 means tcache_count / 2
+
+    bool   slab;            // Serve requests up to SLAB_MAX_SIZE from slabs, without header.
+                            // A bitmap of one bit per SLAB_SIZE bytes is allocated in the arena
+
+    bool   grow;                                // When the region is full, get chunks from the page provider
+    size_t grow_chunk_size;                     // Minimum chunk size, 0 means GROW_CHUNK_SIZE. Capped to the links reach with TINYALLOC_LINK_BITS
+    arena_page_provider_t page_provider;        // NULL alloc means mmap / VirtualAlloc
+
+    size_t   trim_threshold;    // Smallest gap purged by the decay timer, 0 means TRIM_THRESHOLD
+    unsigned trim_decay_ms;     // a_free purges the gaps at most once every trim_decay_ms, 0 disables it
+    bool     trim_zeroes;       // Purged pages of the region read back as zero: a private anonymous mapping
+                                // (Example: mmap MAP_PRIVATE | MAP_ANONYMOUS), not a shared or file mapping.
+                                // Chunks use page_provider.zeroed
+
+    arena_profile_hooks_t profile_hooks;        // Only with TINYALLOC_PROFILE
+
+    size_t sample_rate;         // Only with TINYALLOC_SAMPLING: mean bytes between samples, 0 disables sampling
+    size_t sample_capacity;     // Samples kept at once, 0 means SAMPLE_CAPACITY. The table is allocated in the arena
+
+    size_t trace_capacity;      // Only with TINYALLOC_TRACE: events buffered before a drain, 0 disables the recorder.
+                                // The ring is allocated in the arena
+
+    size_t handle_capacity;     // Handles available to a_halloc, 0 disables them. The table is allocated in the arena
+
+    uintptr_t canary_secret;                    // Mixed in the header canaries, 0 picks a random one
+    arena_corruption_hooks_t corruption_hooks;  // Only with TINYALLOC_HARDENED
+
+    bool   remote_free;         // Frees from other threads than the owner are queued without locking. Needs pthread
+
+    bool   linear;              // Only a_bump_alloc, arena_mark and arena_reset_to. Every other option is ignored
+} arena_config_t;
+
 // arena
 typedef struct {
     void*   start_addr;
     size_t  arena_size;
-    void*   head;
-    void*   tail;
+    void*   head;   // First block of the list (boundary tags: first block of the arena)
+    void*   tail;   // Last block of the list (boundary tags: end tag)
+
+    arena_policy_t policy;
+    uintptr_t      rover;       // ARENA_POLICY_NEXT_FIT: end of the last block placed
+
+    // Segregated index of the free gaps between blocks
+    size_t   free_fl_bitmap;
+    uint32_t free_sl_bitmap[FREE_FL_COUNT];
+    void*    free_bins[FREE_FL_COUNT][FREE_SL_COUNT];
+    void*    tail_gap;      // Indexed gap after the last block, NULL if there is none
+    size_t   gap_bound;     // No other indexed gap is bigger, lookups above it skip the bins
+    bool     prefer_tail;
+
+    uintptr_t zero_start;   // Bytes in [zero_start, zero_end) were never handed out, or purged since
+    uintptr_t zero_end;
+
+    arena_lock_type_t  lock_type;
+    arena_lock_hooks_t lock_hooks;
+    int                spinlock;
+#if TINYALLOC_PTHREAD
+    pthread_mutex_t    arena_mutex;
+#endif
+
+    size_t   tcache_count;
+    size_t   tcache_batch;
+    unsigned tcache_id;     // Tells apart arenas initialized at the same address
+
+#if TINYALLOC_SLAB
+    size_t*  slab_map;                          // One bit per SLAB_SIZE page, set on slabs. NULL if disabled
+    void*    slab_partial[SLAB_CLASS_COUNT];    // Slabs with free slots, per size class
+    void*    slab_spare;                        // One empty slab kept to avoid thrashing
+#endif
+
+#if TINYALLOC_GROW
+    void*    chunks;                            // Chunks from the page provider, most recent first
+    void*    chunk_index;                       // The same chunks sorted by address, from the page provider
+    size_t   chunk_count;
+    size_t   chunk_index_size;                  // Bytes of chunk_index
+    bool     grow;
+    size_t   grow_chunk_size;
+    arena_page_provider_t page_provider;
+#endif
+
+    size_t   trim_threshold;
+    unsigned trim_decay_ms;
+    uint64_t trim_last_ms;
+    bool     trim_zeroes;
 
-    // pthread_mutex_t arena_mutex;
+    // Statistics, updated with the arena locked
+    void*    stats_arena;       // Arena updated by the blocks of this one (itself, or the parent of a chunk)
+    size_t   allocated_size;
+    size_t   allocated_blocks;
+    size_t   peak_allocated_size;
+    size_t   alloc_count;
+    size_t   failed_count;
+
+#if TINYALLOC_PROFILE
+    arena_profile_t       profile;
+    arena_profile_hooks_t profile_hooks;
+#endif
+
+    void*    handle_table;      // Data pointer of every handle, or the next free index. NULL if disabled
+    size_t   handle_capacity;
+    size_t   handle_free;       // First free handle index
+
+    uintptr_t canary_secret;
+#if TINYALLOC_HARDENED
+    arena_corruption_hooks_t corruption_hooks;
+#endif
+
+    void*    remote_owner;      // Thread that drains the remote frees, NULL if disabled
+    void*    remote_head;       // Blocks freed by other threads, linked through their first word
+
+    bool     linear;
+    size_t   bump_top;          // Offset of the first free byte of a linear arena
+
+#if TINYALLOC_SAMPLING
+    void*    sample_table;      // Live samples hash table, NULL if disabled
+    uint32_t* sample_homes;     // Live samples per home slot of the table, read by a_free without the lock
+    size_t   sample_rate;
+    size_t   sample_capacity;
+    size_t   sample_live;
+    size_t   sample_dropped;    // Samples not recorded because the table was full
+#endif
+
+#if TINYALLOC_TRACE
+    void*    trace_ring;        // Ring of events, NULL if disabled
+    size_t   trace_capacity;
+    size_t   trace_head;        // Next position written
+    size_t   trace_tail;        // Next position drained
+    size_t   trace_dropped;     // Events lost because the ring was full
+    FILE*    trace_file;        // NULL while not recording
+    bool     trace_active;
+    int      trace_draining;
+#if TINYALLOC_PTHREAD
+    pthread_t trace_thread;
+#endif
+#endif
 } arena_t;
 
 typedef struct {
@@ -48,45 +365,242 @@ typedef struct {
     size_t fragmentation_bytes;
 
     size_t allocated_blocks;
+    size_t largest_gap_size;        // Biggest free gap, bigger blocks can't be placed without growing
+
+    size_t peak_allocated_size;     // Highest allocated_size since arena_init
+    size_t alloc_count;             // Allocation requests served (malloc, aligned, realloc, batch blocks)
+    size_t failed_count;            // Allocation requests that returned NULL (or a short batch)
 } arena_info_t;
 
+// Handle of a relocatable allocation, 0 is never a valid handle
+typedef size_t arena_handle_t;
 
-union allocator_header {
-    struct {
-        canary_t canary;
-        size_t  size; // data size
-        void*   prev;
-        void*   next;
-    };
-    ALIGN align;
-};
+// Checkpoint of a linear arena, 0 is the empty arena
+typedef size_t arena_mark_t;
+
+// arena pool: a region split in shards, each one with its own arena and lock
+typedef struct {
+    void*    start_addr;    // Set by the user before arena_pool_init
+    size_t   pool_size;     // Set by the user before arena_pool_init
+    size_t   shard_count;   // Set by the user before arena_pool_init, 0 means one per online CPU
+
+    arena_t* shards;        // Shard arenas, stored at the start of the region
+    void*    shards_start;  // Memory of the first shard, the others follow every shard_size bytes
+    size_t   shard_size;
+} arena_pool_t;
 
-typedef union allocator_header allocator_header_t;
+
+typedef struct allocator_header {
+#if TINYALLOC_CANARY
+    canary_t     canary;
+#endif
+    block_size_t size; // data size
+    block_link_t prev;
+    block_link_t next;
+} allocator_header_t;
+
+typedef uint8_t ALIGN[HEADER_LENGHT];
 
 // arena functions
 
 /**
  * @brief Prepares the arena for usage
  * 
- * @param arena_ptr 
+ * @param arena_ptr Pointer to the arena struct. start_addr and arena_size must be set before calling this
  */
 void arena_init(arena_t* arena_ptr);
 
+/**
+ * @brief Prepares the arena for usage with a custom configuration
+ * 
+ * @param arena_ptr Pointer to the arena struct. start_addr and arena_size must be set before calling this
+ * @param config Pointer to the configuration, or NULL to use the defaults (same as arena_init)
+ * 
+ * With config->grow the arena takes chunks of at least grow_chunk_size bytes from the page provider
+ * when its region is full. Chunks left empty are given back to the provider, keeping one of them.
+ * start_addr and arena_size can be NULL and 0, then all the memory comes from chunks
+ *
+ * The list format aligns start_addr up to TINYALLOC_MIN_ALIGN (arena_size loses the bytes skipped),
+ * and with TINYALLOC_LINK_BITS cuts arena_size and the chunks to the bytes the links reach
+ * 
+ * With config->linear nothing is stored in the region and only the bump functions can be used on
+ * the arena. The region can be a block from another arena (Example: a_malloc(&heap, 64 * 1024))
+ * 
+ * With config->remote_free the calling thread is the owner of the arena, see arena_set_owner
+ * 
+ * With TINYALLOC_HARDENED a_free and a_realloc check the header of the block and of its neighbours
+ * (the canaries, or the boundary tags and footers), or that a slab slot is live, and a_malloc checks
+ * the links of the gaps it visits. The thread cache is disabled, so every a_free is checked.
+ * A corrupted block is reported to config->corruption_hooks, and if the handler returns the block is
+ * left as it is (a_realloc returns NULL, a_malloc fails). The arena should not be trusted after that
+ */
+void arena_init_ex(arena_t* arena_ptr, const arena_config_t* config);
+
 /**
  * @brief Releases the arena
  * 
- * @param arena_ptr 
+ * @param arena_ptr Pointer to the arena struct. The lock is destroyed, no other thread may be using the arena
+ * 
+ * All the chunks of a growable arena are given back to the page provider
  */
 void arena_destroy(arena_t* arena_ptr);
 
+/**
+ * @brief Fork handlers of an arena shared by threads (Example: pthread_atfork)
+ * 
+ * @param arena_ptr Pointer to the arena struct
+ * 
+ * arena_fork_prepare takes the lock of the arena before fork, so no other thread holds it while
+ * the process is copied. arena_fork_parent releases it in the parent and arena_fork_child sets it
+ * up again in the child. Blocks cached by the threads that are not copied stay allocated
+ */
+void arena_fork_prepare(arena_t* arena_ptr);
+void arena_fork_parent(arena_t* arena_ptr);
+void arena_fork_child(arena_t* arena_ptr);
+
 /**
  * @brief Fills an arena_info_t struct with information about the allocator and the arena
  * 
  * @param arena_ptr Pointer to the arena struct
  * @param arena_info_ptr Pointer to the info struct to be filled
+ * 
+ * The counters are kept up to date by every allocation and free, so no block is walked.
+ * Blocks in thread caches and slabs count as allocated, requests served from a thread cache
+ * are added to alloc_count when the cache next locks the arena
  */
 void arena_info(arena_t* arena_ptr, arena_info_t* arena_info_ptr);
 
+/**
+ * @brief Slides the blocks of handles towards start_addr to merge the free gaps
+ * 
+ * @param arena_ptr Pointer to the arena struct
+ * @return size_t Handle blocks moved. 0 if the arena has no handles
+ * 
+ * Blocks from a_malloc stay where they are, so only the gaps between handle blocks and before them
+ * are recovered. Pointers returned by a_hptr are not valid after a compaction, no other thread may
+ * be using them. In a growable arena every chunk is compacted on its own
+ */
+size_t arena_compact(arena_t* arena_ptr);
+
+/**
+ * @brief Makes the calling thread the owner of an arena initialized with config->remote_free
+ * 
+ * @param arena_ptr Pointer to the arena struct
+ * 
+ * a_free from any other thread pushes the block on a lock-free queue, and the owner frees the
+ * queued blocks in batches at its next a_malloc. Queued blocks are counted as allocated until then.
+ * Does nothing if the arena has no remote free queue
+ */
+void arena_set_owner(arena_t* arena_ptr);
+
+/**
+ * @brief Returns a checkpoint of a linear arena
+ * 
+ * @param arena_ptr Pointer to the arena struct initialized with config->linear
+ * @return arena_mark_t Current top of the arena, to be passed to arena_reset_to
+ */
+arena_mark_t arena_mark(arena_t* arena_ptr);
+
+/**
+ * @brief Frees everything allocated in a linear arena after a checkpoint
+ * 
+ * @param arena_ptr Pointer to the arena struct initialized with config->linear
+ * @param mark Checkpoint returned by arena_mark, or 0 to free the whole arena
+ * 
+ * Checkpoints nest: resetting to a mark also drops the marks taken after it.
+ * Marks above the current top are ignored. Takes constant time
+ */
+void arena_reset_to(arena_t* arena_ptr, arena_mark_t mark);
+
+/**
+ * @brief Copies the instrumentation counters of the arena
+ * 
+ * @param arena_ptr Pointer to the arena struct
+ * @param profile_ptr Pointer to the struct to be filled, all zero if TINYALLOC_PROFILE is 0
+ * 
+ * The walk histogram shows how many too small gaps the first fit search of ARENA_POLICY_GOOD_FIT
+ * skips, ARENA_POLICY_TLSF never skips any. For the other policies it counts every gap compared. Requests served by a chunk of a growable arena are counted too
+ */
+void arena_profile_info(arena_t* arena_ptr, arena_profile_t* profile_ptr);
+
+/**
+ * @brief Sets the instrumentation counters of the arena to zero
+ * 
+ * @param arena_ptr Pointer to the arena struct
+ */
+void arena_profile_reset(arena_t* arena_ptr);
+
+/**
+ * @brief Writes the live sampled allocations as a heap profile readable by pprof
+ * 
+ * @param arena_ptr Pointer to the arena struct
+ * @param file Stream to write to (Example: fopen("heap.prof", "w"))
+ * @return true on success, false if sampling is disabled or TINYALLOC_SAMPLING is 0
+ * 
+ * The gperftools heap_v2 text format is used, with the mappings of /proc/self/maps when available.
+ * Only a_malloc is sampled, the backtraces use backtrace() on glibc and macOS
+ */
+bool arena_sample_dump(arena_t* arena_ptr, FILE* file);
+
+/**
+ * @brief Starts recording the calls of the arena to a file
+ * 
+ * @param arena_ptr Pointer to the arena struct initialized with config->trace_capacity
+ * @param file Binary stream to write to (Example: fopen("trace.bin", "wb")), kept open by the caller
+ * @return true on success, false if the recorder is disabled, already recording or TINYALLOC_TRACE is 0
+ * 
+ * Every a_malloc, a_aligned_alloc, a_realloc, a_free and batch call adds an arena_trace_event_t to
+ * the ring without locking, a thread writes them to file every TRACE_DRAIN_MS. Without pthread
+ * arena_trace_drain must be called instead. The file is read by the trace replay of bench/bench.c
+ */
+bool arena_trace_start(arena_t* arena_ptr, FILE* file);
+
+/**
+ * @brief Writes the events recorded so far to the file of the recording
+ * 
+ * @param arena_ptr Pointer to the arena struct
+ * @return size_t Events written. 0 if another thread is draining
+ */
+size_t arena_trace_drain(arena_t* arena_ptr);
+
+/**
+ * @brief Stops recording, the pending events are written and the file is flushed
+ * 
+ * @param arena_ptr Pointer to the arena struct
+ * @return size_t Events dropped because the ring was full since the recording started
+ * 
+ * Events of calls running at the same time may be lost. arena_destroy stops the recording
+ */
+size_t arena_trace_stop(arena_t* arena_ptr);
+
+/**
+ * @brief Gives the pages inside big free gaps back to the OS
+ * 
+ * @param arena_ptr Pointer to the arena struct
+ * @param threshold Only gaps of at least threshold bytes are purged, 0 means any gap spanning a whole page
+ * @return size_t Bytes purged
+ * 
+ * The pages are released with madvise(MADV_DONTNEED), the address range stays in the arena and
+ * the pages are mapped again when a block uses them: zero filled only for private anonymous memory,
+ * so a_calloc counts on it with config->trim_zeroes (chunks: a zeroed page provider). Does nothing
+ * on systems without madvise.
+ * With config->trim_decay_ms, a_free does this with config->trim_threshold once every trim_decay_ms
+ */
+size_t arena_trim(arena_t* arena_ptr, size_t threshold);
+
+/**
+ * @brief Returns the blocks cached by the calling thread for this arena
+ * 
+ * @param arena_ptr Pointer to the arena struct
+ * 
+ * Cached blocks are counted as allocated by arena_info. Caches are flushed when a thread exits,
+ * but every thread that used the arena must call this before the arena is destroyed
+ * (arena_destroy does it for the calling thread). Caches still held by other threads are dropped,
+ * not flushed, when they exit: the arena_t must stay readable until then. Does nothing if the arena
+ * has no thread cache
+ */
+void arena_tcache_flush(arena_t* arena_ptr);
+
 
 
 // Allocator functions
@@ -98,10 +612,63 @@ void arena_info(arena_t* arena_ptr, arena_info_t* arena_info_ptr);
  * @param size Size of the memory to allocate in bytes. It will be padded to the nearest ISA word size
  * @return void* Pointer to memory allocated or NULL on error (Example: Not enought memory)
  * 
- * The allocator will use the first-fit algorithm
+ * The free gaps between blocks are kept in two level size classes, so no block list walk is needed.
+ * ARENA_POLICY_GOOD_FIT looks for the first fit in the class of the request and otherwise takes the
+ * first gap of the next non-empty bigger class. ARENA_POLICY_TLSF rounds the request up to the next
+ * class and takes the first gap there, so the time spent is bounded. ARENA_POLICY_BEST_FIT looks at
+ * every gap of those two classes for the smallest fit. ARENA_POLICY_FIRST_FIT and ARENA_POLICY_NEXT_FIT
+ * compare the addresses of every gap in the classes that can fit, they trade speed for less fragmentation
+ * 
+ * The gap after the last block is tracked apart from the others, along with a bound on their size.
+ * Requests above the bound skip the classes and go straight after the last block or fail. With the
+ * prefer_tail option, requests go after the last block whenever it has room
+ * 
+ * If the arena has a thread cache, requests up to TCACHE_MAX_SIZE are served from it without locking.
+ * If the arena has slabs, requests up to SLAB_MAX_SIZE are served from slots without header.
+ * If the arena can grow and no gap is big enough, the request is served from a chunk
  */
 void* a_malloc(arena_t* arena_ptr, size_t size);
 
+/**
+ * @brief Allocates memory aligned to alignment bytes in the arena pointed by arena_ptr
+ * 
+ * @param arena_ptr Pointer to the arena_t struct previously initialized
+ * @param alignment Alignment of the returned pointer in bytes, must be a power of two (Example: 64 for a cache line)
+ * @param size Size of the memory to allocate in bytes. It will be padded to the nearest ISA word size
+ * @return void* Pointer to memory allocated or NULL on error (Example: Not enought memory or invalid alignment)
+ * 
+ * The header is placed right before the aligned address and the padding before it stays as
+ * free space that can be reused. The pointer can be passed to a_free and a_realloc like any other,
+ * but a_realloc only keeps the alignment when the block is resized in place
+ */
+void* a_aligned_alloc(arena_t* arena_ptr, size_t alignment, size_t size);
+
+/**
+ * @brief Allocates zeroed memory for count elements of size bytes in the arena pointed by arena_ptr
+ * 
+ * @param arena_ptr Pointer to the arena_t struct previously initialized
+ * @param count Number of elements
+ * @param size Size of an element in bytes
+ * @return void* Pointer to memory allocated or NULL on error (Example: Not enought memory or count * size overflows)
+ * 
+ * The arena keeps a range of bytes known to be zero: the untouched end of a region initialized
+ * with config->zeroed or of a chunk from a zeroed page provider, or the pages purged by arena_trim
+ * (with config->trim_zeroes).
+ * The part of a new block inside of it is not cleared, the rest is cleared with memset
+ */
+void* a_calloc(arena_t* arena_ptr, size_t count, size_t size);
+
+/**
+ * @brief Allocates zeroed memory aligned to alignment bytes, like a_calloc
+ * 
+ * @param arena_ptr Pointer to the arena_t struct previously initialized
+ * @param alignment Alignment of the returned pointer in bytes, must be a power of two
+ * @param count Number of elements
+ * @param size Size of an element in bytes
+ * @return void* Pointer to memory allocated or NULL on error
+ */
+void* a_aligned_calloc(arena_t* arena_ptr, size_t alignment, size_t count, size_t size);
+
 /**
  * @brief Reallocates memory in the arena pointed by arena_ptr
  * 
@@ -110,18 +677,230 @@ void* a_malloc(arena_t* arena_ptr, size_t size);
  * @param size Size of the memory to rellocate in bytes. It will be padded to the nearest ISA word size
  * @return void* New pointer to the block, or NULL on error. The new pointer can be different to the last block pointer
  * 
- * The allocator will use the first-fit algorithm, but only if the block couldn't be resized to the new size
+ * The block is resized in place if the gap after it is big enough, if the gaps before and after it are
+ * big enough it is moved down into the gap before it, otherwise a new block is allocated.
+ * The whole operation (including the copy to a new block) is done with the arena locked
  */
 void* a_realloc(arena_t* arena_ptr, void* ptr, size_t size);
 
+/**
+ * @brief Reallocates memory in the arena pointed by arena_ptr, reserving extra capacity when possible
+ * 
+ * @param arena_ptr Pointer to the arena_t struct previously initialized
+ * @param ptr Pointer to the previously allocated block or NULL to perform an allocation
+ * @param min_size Minimum size of the block in bytes
+ * @param preferred_size Size of the block in bytes to reserve if there is room for it (Example: Twice the current size)
+ * @param actual_size If not NULL, set to the usable size of the returned block or 0 on error
+ * @return void* New pointer to the block, or NULL on error. The new pointer can be different to the last block pointer
+ * 
+ * If the block can be grown in place to at least min_size, it takes as much of preferred_size as
+ * the contiguous space allows. If it has to be moved, preferred_size is tried first and then min_size.
+ * Useful for dynamic arrays and string builders growing by small steps
+ */
+void* a_realloc_ex(arena_t* arena_ptr, void* ptr, size_t min_size, size_t preferred_size, size_t* actual_size);
+
+/**
+ * @brief Returns the usable size of a block in the arena pointed by arena_ptr
+ * 
+ * @param arena_ptr Pointer to the arena_t struct previously initialized
+ * @param ptr Valid pointer previously returned from a_malloc or a_realloc, or NULL
+ * @return size_t Bytes usable at ptr, at least the size requested. 0 for NULL
+ * 
+ * The arena is needed to know if the pointer is a slab slot. The arena is not locked
+ */
+size_t a_usable_size(arena_t* arena_ptr, void* ptr);
+
 /**
  * @brief Frees memory in the arena pointed by arena_ptr
  * 
  * @param arena_ptr Pointer to the arena_t struct previously initialized
  * @param ptr Valid pointer previously returned from a_malloc or a_realloc
  * 
+ * The gap left by the block is merged with the gaps on both sides and put back in the free index
  * NOTE: This can cause memory fragmentation
  */
 void  a_free(arena_t* arena_ptr, void* ptr);
 
+/**
+ * @brief Frees memory in the arena pointed by arena_ptr, given the size it was requested with
+ * 
+ * @param arena_ptr Pointer to the arena_t struct previously initialized
+ * @param ptr Valid pointer previously returned from the arena, or NULL
+ * @param size Size passed to the allocation (or the last a_realloc), or 0 if unknown
+ * 
+ * Same as a_free (Example: C++ sized delete), but the thread cache takes the block in the class
+ * of size without reading its slab or header. size must not be bigger than the one requested:
+ * the block would be cached for requests it can't hold. With 0 the class comes from the arena, and
+ * sampled blocks always take the a_free path. With TINYALLOC_HARDENED there is no thread cache and
+ * a size bigger than the block is reported as corruption, the block is not freed
+ */
+void  a_free_sized(arena_t* arena_ptr, void* ptr, size_t size);
+
+
+/**
+ * @brief Allocates count blocks of the same size in the arena pointed by arena_ptr
+ * 
+ * @param arena_ptr Pointer to the arena_t struct previously initialized
+ * @param size Size of every block in bytes. It will be padded to the nearest ISA word size
+ * @param count Number of blocks to allocate
+ * @param out Array of at least count pointers where the blocks are stored
+ * @return size_t Number of blocks allocated, stored from out[0]. Less than count if the arena is full
+ * 
+ * The arena is locked once for all the blocks. They are carved as contiguous runs from the
+ * biggest gaps found and linked in a single pass. The thread cache is not used
+ */
+size_t a_malloc_batch(arena_t* arena_ptr, size_t size, size_t count, void** out);
+
+/**
+ * @brief Frees count blocks in the arena pointed by arena_ptr
+ * 
+ * @param arena_ptr Pointer to the arena_t struct previously initialized
+ * @param ptrs Array of valid pointers previously returned from the arena, NULL entries are skipped
+ * @param count Number of pointers in ptrs
+ * 
+ * The arena is locked once for all the blocks. The pointers are sorted by address (ptrs is
+ * reordered) so runs of adjacent blocks are unlinked together and leave a single gap.
+ * The thread cache is not used
+ */
+void  a_free_batch(arena_t* arena_ptr, void** ptrs, size_t count);
+
+/**
+ * @brief Allocates a relocatable block in the arena pointed by arena_ptr
+ * 
+ * @param arena_ptr Pointer to the arena_t struct initialized with config->handle_capacity
+ * @param size Size of the memory to allocate in bytes. It will be padded to the nearest ISA word size
+ * @return arena_handle_t Handle of the block, or 0 on error (Example: Not enought memory or no free handle)
+ * 
+ * The block can be moved by arena_compact, a_hptr returns where it currently is.
+ * Handle blocks take one more word than a_malloc blocks and are never served from slabs
+ */
+arena_handle_t a_halloc(arena_t* arena_ptr, size_t size);
+
+/**
+ * @brief Returns the current address of a handle block
+ * 
+ * @param arena_ptr Pointer to the arena_t struct previously initialized
+ * @param handle Handle returned by a_halloc
+ * @return void* Pointer to the data, valid until the next arena_compact, a_hrealloc or a_hfree. NULL for invalid handles
+ */
+void* a_hptr(arena_t* arena_ptr, arena_handle_t handle);
+
+/**
+ * @brief Reallocates a handle block, the handle stays the same
+ * 
+ * @param arena_ptr Pointer to the arena_t struct previously initialized
+ * @param handle Handle returned by a_halloc
+ * @param size New size of the block in bytes
+ * @return true on success, false on error (the block is not modified)
+ */
+bool  a_hrealloc(arena_t* arena_ptr, arena_handle_t handle, size_t size);
+
+/**
+ * @brief Frees a handle block and its handle
+ * 
+ * @param arena_ptr Pointer to the arena_t struct previously initialized
+ * @param handle Handle returned by a_halloc, invalid handles are ignored
+ */
+void  a_hfree(arena_t* arena_ptr, arena_handle_t handle);
+
+/**
+ * @brief Allocates memory in a linear arena by moving its top
+ * 
+ * @param arena_ptr Pointer to the arena_t struct initialized with config->linear
+ * @param size Size of the memory to allocate in bytes. It will be padded to the nearest ISA word size
+ * @return void* Pointer to memory allocated or NULL on error (Example: Not enought memory)
+ * 
+ * There is no header and no free: the memory is given back with arena_reset_to.
+ * The arena is not locked, a linear arena must be used by one thread at a time
+ */
+void* a_bump_alloc(arena_t* arena_ptr, size_t size);
+
+/**
+ * @brief Allocates memory aligned to alignment bytes in a linear arena, like a_bump_alloc
+ * 
+ * @param arena_ptr Pointer to the arena_t struct initialized with config->linear
+ * @param alignment Alignment of the returned pointer in bytes, must be a power of two
+ * @param size Size of the memory to allocate in bytes
+ * @return void* Pointer to memory allocated or NULL on error
+ * 
+ * The bytes skipped to align the pointer are given back with the rest by arena_reset_to
+ */
+void* a_bump_aligned_alloc(arena_t* arena_ptr, size_t alignment, size_t size);
+
+
+// arena pool functions
+
+/**
+ * @brief Splits the pool region in shards and prepares the arena of each one
+ * 
+ * @param pool_ptr Pointer to the pool struct. start_addr, pool_size and shard_count must be set before calling this
+ * @param config Configuration used by every shard arena, or NULL to use the defaults with ARENA_LOCK_MUTEX.
+ *               grow, linear and remote_free are ignored, the shards only use the pool region
+ * @return true on success, false if the region is too small for the shards
+ * 
+ * The shard arena_t structs are stored at the start of the region
+ */
+bool arena_pool_init(arena_pool_t* pool_ptr, const arena_config_t* config);
+
+/**
+ * @brief Releases the pool and the arenas of its shards
+ * 
+ * @param pool_ptr Pointer to the pool struct
+ */
+void arena_pool_destroy(arena_pool_t* pool_ptr);
+
+/**
+ * @brief Returns the shard arena used by the calling thread
+ * 
+ * @param pool_ptr Pointer to the pool struct previously initialized
+ * @return arena_t* Shard of the CPU the thread runs on (Linux) or picked from a thread hash
+ */
+arena_t* arena_pool_select(arena_pool_t* pool_ptr);
+
+/**
+ * @brief Returns the shard arena owning a pointer
+ * 
+ * @param pool_ptr Pointer to the pool struct previously initialized
+ * @param ptr Any pointer
+ * @return arena_t* Shard whose memory contains ptr, or NULL if ptr is not in the pool
+ */
+arena_t* arena_pool_owner(arena_pool_t* pool_ptr, void* ptr);
+
+/**
+ * @brief Allocates memory in the shard of the calling thread
+ * 
+ * @param pool_ptr Pointer to the pool struct previously initialized
+ * @param size Size of the memory to allocate in bytes
+ * @return void* Pointer to memory allocated or NULL on error
+ * 
+ * If the selected shard is full, the other shards are tried in order
+ */
+void* a_pool_malloc(arena_pool_t* pool_ptr, size_t size);
+
+/**
+ * @brief Reallocates memory in the shard owning ptr
+ * 
+ * @param pool_ptr Pointer to the pool struct previously initialized
+ * @param ptr Pointer previously returned by the pool or NULL to perform an a_pool_malloc operation
+ * @param size New size in bytes
+ * @return void* New pointer to the block, or NULL on error
+ * 
+ * If the owner shard can't hold the new size, the block is moved to another shard.
+ * A ptr outside of the pool returns NULL (and goes to the corruption hook when hardened)
+ */
+void* a_pool_realloc(arena_pool_t* pool_ptr, void* ptr, size_t size);
+
+/**
+ * @brief Frees memory in the shard owning ptr
+ * 
+ * @param pool_ptr Pointer to the pool struct previously initialized
+ * @param ptr Pointer previously returned by the pool, from any thread. A ptr outside of the
+ *            pool is ignored (and goes to the corruption hook when hardened)
+ */
+void  a_pool_free(arena_pool_t* pool_ptr, void* ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif 
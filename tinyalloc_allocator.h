@@ -0,0 +1,171 @@
+/**
+ * @file tinyalloc_allocator.h
+ * @author Brais Solla González
+ * @brief C++ allocator and memory resources on top of a tinyalloc arena
+ * @version 0.3
+ * @date 2021-09-07
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+
+#ifndef _TINYALLOC_ALLOCATOR_INCLUDED
+#define _TINYALLOC_ALLOCATOR_INCLUDED
+
+#ifndef __cplusplus
+#error "tinyalloc_allocator.h is only for C++"
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "tinyalloc_new.h"
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define TINYALLOC_MEMORY_RESOURCE 1
+#endif
+#endif
+
+namespace tinyalloc {
+
+/**
+ * Allocator of the standard containers on a given arena, without replacing the global new:
+ *
+ *     std::vector<int, tinyalloc::arena_allocator<int>> v{tinyalloc::arena_allocator<int>(&arena)};
+ *
+ * Copies share the arena and compare equal. The arena must outlive the containers
+ */
+template<class T>
+class arena_allocator {
+public:
+    using value_type = T;
+
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap            = std::true_type;
+
+    explicit arena_allocator(arena_t* arena_ptr) noexcept : arena_ptr_(arena_ptr) {}
+
+    template<class U>
+    arena_allocator(const arena_allocator<U>& other) noexcept : arena_ptr_(other.arena()) {}
+
+    T* allocate(std::size_t count){
+        if(count > SIZE_MAX / sizeof(T)) detail::throw_bad_alloc();
+
+        return static_cast<T*>(operator_new(arena_ptr_, count * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* ptr, std::size_t count) noexcept {
+        a_free_sized(arena_ptr_, ptr, count * sizeof(T));
+    }
+
+    arena_t* arena() const noexcept {
+        return arena_ptr_;
+    }
+
+private:
+    arena_t* arena_ptr_;
+};
+
+template<class T, class U>
+bool operator==(const arena_allocator<T>& a, const arena_allocator<U>& b) noexcept {
+    return a.arena() == b.arena();
+}
+
+template<class T, class U>
+bool operator!=(const arena_allocator<T>& a, const arena_allocator<U>& b) noexcept {
+    return a.arena() != b.arena();
+}
+
+#if TINYALLOC_MEMORY_RESOURCE
+
+/**
+ * std::pmr::memory_resource on a general purpose arena: do_allocate honours the alignment with
+ * a_aligned_alloc, do_deallocate passes the size to a_free_sized
+ */
+class arena_resource : public std::pmr::memory_resource {
+public:
+    explicit arena_resource(arena_t* arena_ptr) noexcept : arena_ptr_(arena_ptr) {}
+
+    arena_t* arena() const noexcept {
+        return arena_ptr_;
+    }
+
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        return operator_new(arena_ptr_, bytes, alignment);
+    }
+
+    void do_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) override {
+        (void) alignment;
+        a_free_sized(arena_ptr_, ptr, bytes);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    arena_t* arena_ptr_;
+};
+
+/**
+ * std::pmr::memory_resource on a linear arena (config->linear): every allocation moves the top
+ * of the arena with a_bump_aligned_alloc and deallocations do nothing. release (and the
+ * destructor) reset the arena to the mark taken at construction, so resources nest:
+ *
+ *     tinyalloc::monotonic_arena_resource request(&scratch);
+ *     std::pmr::vector<int> v(&request);
+ *
+ * The arena is not locked, one resource per thread. Throws std::bad_alloc when the arena is full
+ */
+class monotonic_arena_resource : public std::pmr::memory_resource {
+public:
+    explicit monotonic_arena_resource(arena_t* arena_ptr) noexcept : arena_ptr_(arena_ptr), mark_(arena_mark(arena_ptr)) {}
+
+    monotonic_arena_resource(const monotonic_arena_resource&)            = delete;
+    monotonic_arena_resource& operator=(const monotonic_arena_resource&) = delete;
+
+    ~monotonic_arena_resource() override {
+        release();
+    }
+
+    void release() noexcept {
+        arena_reset_to(arena_ptr_, mark_);
+    }
+
+    arena_t* arena() const noexcept {
+        return arena_ptr_;
+    }
+
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        void* ptr = a_bump_aligned_alloc(arena_ptr_, alignment, bytes);
+        if(!ptr) detail::throw_bad_alloc();
+
+        return ptr;
+    }
+
+    void do_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) override {
+        (void) ptr;
+        (void) bytes;
+        (void) alignment;
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    arena_t*     arena_ptr_;
+    arena_mark_t mark_;
+};
+
+#endif
+
+} // namespace tinyalloc
+
+#endif
@@ -0,0 +1,52 @@
+/**
+ * @file tinyalloc_config.h
+ * @author Brais Solla González
+ * @brief Compile time layout of the tinyalloc blocks
+ * @version 0.3
+ * @date 2021-09-07
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+
+#ifndef _TINYALLOC_CONFIG_INCLUDED
+#define _TINYALLOC_CONFIG_INCLUDED
+
+// Every option can be set here or with -D, the defaults keep the layout of a 4 word header.
+// The header options only apply to the block list format (TINYALLOC_BOUNDARY_TAGS 0)
+
+// Links between blocks in allocator_header_t: 0 for pointers, 16 or 32 for offsets from the start
+// of the arena in TINYALLOC_MIN_ALIGN units. Arenas are cut to the bytes the links reach, and chunks
+// are asked for no more: (2^16 - 1) * TINYALLOC_MIN_ALIGN with 16 bits. arena_init aligns start_addr up
+// to TINYALLOC_MIN_ALIGN
+#ifndef TINYALLOC_LINK_BITS
+#define TINYALLOC_LINK_BITS 0
+#endif
+
+// Data size in allocator_header_t: 0 for size_t, 16 or 32 bits. Bigger requests fail
+#ifndef TINYALLOC_SIZE_BITS
+#define TINYALLOC_SIZE_BITS 0
+#endif
+
+// Alignment of every block and of the header length, a power of two not below sizeof(void*).
+// Boundary tags only support sizeof(void*)
+#ifndef TINYALLOC_MIN_ALIGN
+#define TINYALLOC_MIN_ALIGN (sizeof(void*))
+#endif
+
+// Canary word in allocator_header_t, required by TINYALLOC_HARDENED. Without hardened mode
+// it is written but never checked
+#ifndef TINYALLOC_CANARY
+#define TINYALLOC_CANARY 1
+#endif
+
+#if TINYALLOC_LINK_BITS != 0 && TINYALLOC_LINK_BITS != 16 && TINYALLOC_LINK_BITS != 32
+#error "TINYALLOC_LINK_BITS must be 0, 16 or 32"
+#endif
+
+#if TINYALLOC_SIZE_BITS != 0 && TINYALLOC_SIZE_BITS != 16 && TINYALLOC_SIZE_BITS != 32
+#error "TINYALLOC_SIZE_BITS must be 0, 16 or 32"
+#endif
+
+#endif
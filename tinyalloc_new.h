@@ -0,0 +1,157 @@
+/**
+ * @file tinyalloc_new.h
+ * @author Brais Solla González
+ * @brief C++ operator new / delete on top of a tinyalloc arena
+ * @version 0.3
+ * @date 2021-09-07
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+
+#ifndef _TINYALLOC_NEW_INCLUDED
+#define _TINYALLOC_NEW_INCLUDED
+
+#ifndef __cplusplus
+#error "tinyalloc_new.h is only for C++"
+#endif
+
+#include <cstddef>
+#include <new>
+
+#include "tinyalloc.h"
+
+// Alignment of every pointer returned by the operators without an alignment argument.
+// Set it to sizeof(void*) to keep the thread cache and the slabs when that is enough
+#ifndef TINYALLOC_NEW_ALIGN
+#ifdef __STDCPP_DEFAULT_NEW_ALIGNMENT__
+#define TINYALLOC_NEW_ALIGN ((std::size_t) __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+#else
+#define TINYALLOC_NEW_ALIGN (alignof(std::max_align_t))
+#endif
+#endif
+
+namespace tinyalloc {
+
+namespace detail {
+
+inline void* new_retry(arena_t* arena_ptr, std::size_t size, std::size_t alignment){
+    // Calls the new handler until the arena has room, nullptr if there is no handler
+    if(!size) size = 1;
+
+    for(;;){
+        void* ptr = (alignment <= (std::size_t) ALIGN_SIZE) ? a_malloc(arena_ptr, size) : a_aligned_alloc(arena_ptr, alignment, size);
+        if(ptr) return ptr;
+
+        std::new_handler handler = std::get_new_handler();
+        if(!handler) return nullptr;
+
+        handler();
+    }
+}
+
+[[noreturn]] inline void throw_bad_alloc(){
+#if defined(__cpp_exceptions)
+    throw std::bad_alloc();
+#else
+    abort();
+#endif
+}
+
+} // namespace detail
+
+/**
+ * @brief Allocates size bytes in the arena with the semantics of operator new
+ *
+ * @param arena_ptr Pointer to the arena_t struct previously initialized
+ * @param size Size of the memory to allocate in bytes, 0 returns a unique pointer
+ * @param alignment Alignment of the returned pointer in bytes, must be a power of two
+ * @return void* Pointer to memory allocated. std::bad_alloc is thrown (abort without exceptions)
+ *               when the arena is full and there is no new handler
+ */
+inline void* operator_new(arena_t* arena_ptr, std::size_t size, std::size_t alignment = TINYALLOC_NEW_ALIGN){
+    void* ptr = detail::new_retry(arena_ptr, size, alignment);
+    if(!ptr) detail::throw_bad_alloc();
+
+    return ptr;
+}
+
+/**
+ * @brief Same as operator_new, but returns nullptr instead of throwing
+ */
+inline void* operator_new_nothrow(arena_t* arena_ptr, std::size_t size, std::size_t alignment = TINYALLOC_NEW_ALIGN) noexcept {
+#if defined(__cpp_exceptions)
+    // The new handler can throw too
+    try {
+        return detail::new_retry(arena_ptr, size, alignment);
+    } catch(...){
+        return nullptr;
+    }
+#else
+    return detail::new_retry(arena_ptr, size, alignment);
+#endif
+}
+
+/**
+ * @brief Frees memory returned by operator_new
+ *
+ * @param arena_ptr Pointer to the arena_t struct previously initialized
+ * @param ptr Pointer previously returned by operator_new, or nullptr
+ * @param size Size passed to operator_new, or 0 if unknown
+ */
+inline void operator_delete(arena_t* arena_ptr, void* ptr, std::size_t size = 0) noexcept {
+    a_free_sized(arena_ptr, ptr, size);
+}
+
+} // namespace tinyalloc
+
+#if defined(__cpp_aligned_new)
+#define TINYALLOC_GLOBAL_ALIGNED_NEW_DELETE(arena_expr)                                                              \
+    void* operator new(std::size_t size, std::align_val_t align)   { return ::tinyalloc::operator_new((arena_expr), size, (std::size_t) align); } \
+    void* operator new[](std::size_t size, std::align_val_t align) { return ::tinyalloc::operator_new((arena_expr), size, (std::size_t) align); } \
+    void* operator new(std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept   { return ::tinyalloc::operator_new_nothrow((arena_expr), size, (std::size_t) align); } \
+    void* operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept { return ::tinyalloc::operator_new_nothrow((arena_expr), size, (std::size_t) align); } \
+    void  operator delete(void* ptr, std::align_val_t) noexcept   { ::tinyalloc::operator_delete((arena_expr), ptr); } \
+    void  operator delete[](void* ptr, std::align_val_t) noexcept { ::tinyalloc::operator_delete((arena_expr), ptr); } \
+    void  operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept   { ::tinyalloc::operator_delete((arena_expr), ptr); } \
+    void  operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { ::tinyalloc::operator_delete((arena_expr), ptr); } \
+    void  operator delete(void* ptr, std::size_t size, std::align_val_t) noexcept   { ::tinyalloc::operator_delete((arena_expr), ptr, size); } \
+    void  operator delete[](void* ptr, std::size_t size, std::align_val_t) noexcept { ::tinyalloc::operator_delete((arena_expr), ptr, size); }
+#else
+#define TINYALLOC_GLOBAL_ALIGNED_NEW_DELETE(arena_expr)
+#endif
+
+#if defined(__cpp_sized_deallocation)
+#define TINYALLOC_GLOBAL_SIZED_DELETE(arena_expr)                                                                    \
+    void  operator delete(void* ptr, std::size_t size) noexcept   { ::tinyalloc::operator_delete((arena_expr), ptr, size); } \
+    void  operator delete[](void* ptr, std::size_t size) noexcept { ::tinyalloc::operator_delete((arena_expr), ptr, size); }
+#else
+#define TINYALLOC_GLOBAL_SIZED_DELETE(arena_expr)
+#endif
+
+/**
+ * Replaces the global operator new and delete (plain, nothrow, sized and aligned) with the arena
+ * returned by arena_expr. Use it once, at namespace scope, in a single translation unit:
+ *
+ *     static arena_t* app_arena(){ static arena_t* arena = make_arena(); return arena; }
+ *     TINYALLOC_GLOBAL_NEW_DELETE(app_arena())
+ *
+ * arena_expr is evaluated on every call and must always give the same arena, already initialized:
+ * static initializers can allocate before main. Every STL container then allocates from the
+ * arena. Sized deletes skip the header lookup of the thread cache, and are checked against the
+ * block with TINYALLOC_HARDENED
+ */
+#define TINYALLOC_GLOBAL_NEW_DELETE(arena_expr)                                                                      \
+    void* operator new(std::size_t size)   { return ::tinyalloc::operator_new((arena_expr), size); }                \
+    void* operator new[](std::size_t size) { return ::tinyalloc::operator_new((arena_expr), size); }                \
+    void* operator new(std::size_t size, const std::nothrow_t&) noexcept   { return ::tinyalloc::operator_new_nothrow((arena_expr), size); } \
+    void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return ::tinyalloc::operator_new_nothrow((arena_expr), size); } \
+    void  operator delete(void* ptr) noexcept   { ::tinyalloc::operator_delete((arena_expr), ptr); }                \
+    void  operator delete[](void* ptr) noexcept { ::tinyalloc::operator_delete((arena_expr), ptr); }                \
+    void  operator delete(void* ptr, const std::nothrow_t&) noexcept   { ::tinyalloc::operator_delete((arena_expr), ptr); } \
+    void  operator delete[](void* ptr, const std::nothrow_t&) noexcept { ::tinyalloc::operator_delete((arena_expr), ptr); } \
+    TINYALLOC_GLOBAL_SIZED_DELETE(arena_expr)                                                                        \
+    TINYALLOC_GLOBAL_ALIGNED_NEW_DELETE(arena_expr)
+
+#endif
@@ -0,0 +1,556 @@
+/**
+ * @file tinyalloc_shim.c
+ * @author Brais Solla González
+ * @brief Global malloc / free replacement on top of a set of tinyalloc arenas
+ * @version 0.3
+ * @date 2021-09-07
+ *
+ * @copyright Copyright (c) 2021
+ *
+ * Preloaded library (POSIX):
+ *     cc -O2 -shared -fPIC -ftls-model=initial-exec -DTINYALLOC_MIN_ALIGN=16 -I. tinyalloc.c tinyalloc_shim.c -lpthread -o libtinyalloc.so
+ *     LD_PRELOAD=./libtinyalloc.so program
+ *
+ * Or build both files with the program (Example: an RTOS image), calling arena_shim_init first
+ * to set the lock hooks and the page provider
+ */
+
+// MAP_ANONYMOUS
+#if !defined(_DEFAULT_SOURCE) && !defined(_GNU_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include "tinyalloc_shim.h"
+
+#include <errno.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+typedef char shim_arenas_fit[(TINYALLOC_SHIM_ARENAS >= 1 && TINYALLOC_SHIM_ARENAS <= 255) ? 1 : -1];
+
+#define SHIM_GRANULE ((uintptr_t) 1 << TINYALLOC_SHIM_GRANULE_LOG2)
+
+static inline uintptr_t shim_align_up(uintptr_t value, uintptr_t align){
+    return (value + (align - 1)) & ~(align - 1);
+}
+
+static void shim_spin_lock(int* lock_ptr){
+    while(__atomic_exchange_n(lock_ptr, 1, __ATOMIC_ACQUIRE)){
+        while(__atomic_load_n(lock_ptr, __ATOMIC_RELAXED));
+    }
+}
+
+static void shim_spin_unlock(int* lock_ptr){
+    __atomic_store_n(lock_ptr, 0, __ATOMIC_RELEASE);
+}
+
+// Setup of the arenas, then the leaves of the ownership map (taken by the page provider of the arenas)
+static int shim_setup_lock;
+static int shim_map_lock;
+
+// Page provider
+//
+// Granules are taken from the user page provider, or from mmap with the mapping trimmed
+// to a granule boundary. The arenas get a wrapper that records the granules in the
+// ownership map before handing them out, and forgets them when they are given back.
+
+#if defined(__unix__) || defined(__APPLE__)
+
+static void* shim_pages_default(void* ctx, size_t size){
+    (void) ctx;
+
+    // Map one granule more and unmap what is outside the aligned range
+    size_t span = size + SHIM_GRANULE;
+    void*  raw  = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(raw == MAP_FAILED) return NULL;
+
+    uintptr_t start = shim_align_up((uintptr_t) raw, SHIM_GRANULE);
+    uintptr_t end   = start + size;
+
+    if(start > (uintptr_t) raw) munmap(raw, (size_t) (start - (uintptr_t) raw));
+    if((uintptr_t) raw + span > end) munmap((void*) end, (size_t) ((uintptr_t) raw + span - end));
+
+    return (void*) start;
+}
+
+static void shim_pages_default_release(void* ctx, void* ptr, size_t size){
+    (void) ctx;
+    munmap(ptr, size);
+}
+
+#elif defined(_WIN32)
+
+static void* shim_pages_default(void* ctx, size_t size){
+    // The allocation granularity is 64 KiB, enough for the default granule
+    (void) ctx;
+    return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+static void shim_pages_default_release(void* ctx, void* ptr, size_t size){
+    (void) ctx;
+    (void) size;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+}
+
+#else
+
+// No default page provider, arena_shim_init must set one
+#define shim_pages_default         NULL
+#define shim_pages_default_release NULL
+
+#endif
+
+static arena_page_provider_t shim_pages = { shim_pages_default, shim_pages_default_release, NULL, true };
+
+static void* shim_pages_alloc(size_t size){
+    if(!shim_pages.alloc) return NULL;
+
+    void* ptr = shim_pages.alloc(shim_pages.ctx, size);
+
+    // A granule shared with memory of someone else can't be told apart
+    if(ptr && ((uintptr_t) ptr & (SHIM_GRANULE - 1))){
+        shim_pages.release(shim_pages.ctx, ptr, size);
+        return NULL;
+    }
+
+    return ptr;
+}
+
+// Ownership map
+//
+// Every granule given to an arena is recorded in a two level radix table keyed by its
+// address, the leaf bytes hold the index of the arena plus one (0 for memory of someone
+// else). Leaves are taken from the page provider the first time a granule under them is
+// recorded and are never given back. Lookups don't lock: a pointer can only be freed after
+// the allocation that returned it, which happened after its granule was recorded.
+
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define SHIM_ADDRESS_BITS 48
+#define SHIM_ROOT_BITS    12
+#else
+#define SHIM_ADDRESS_BITS 32
+#define SHIM_ROOT_BITS    8
+#endif
+
+#define SHIM_LEAF_BITS (SHIM_ADDRESS_BITS - TINYALLOC_SHIM_GRANULE_LOG2 - SHIM_ROOT_BITS)
+#define SHIM_LEAF_SIZE ((size_t) 1 << SHIM_LEAF_BITS)
+
+typedef char shim_granule_fits[(SHIM_LEAF_BITS > 0) ? 1 : -1];
+
+static uint8_t* shim_root[(size_t) 1 << SHIM_ROOT_BITS];
+
+static inline bool shim_key(uintptr_t addr, size_t* root, size_t* leaf){
+    // Addresses above SHIM_ADDRESS_BITS are never recorded (shifted twice, it can be the width of uintptr_t)
+    if((addr >> (SHIM_ADDRESS_BITS - 1)) >> 1) return false;
+
+    uintptr_t key = addr >> TINYALLOC_SHIM_GRANULE_LOG2;
+
+    *root = (size_t) (key >> SHIM_LEAF_BITS);
+    *leaf = (size_t) (key & (SHIM_LEAF_SIZE - 1));
+    return true;
+}
+
+static bool shim_map_reserve(uintptr_t start, uintptr_t end){
+    // Leaves for every granule of [start, end), with shim_map_lock held
+    for(uintptr_t addr = start; addr < end; addr += SHIM_GRANULE){
+        size_t root, leaf;
+        if(!shim_key(addr, &root, &leaf)) return false;
+
+        if(shim_root[root]) continue;
+
+        uint8_t* new_leaf = (uint8_t*) shim_pages_alloc(SHIM_LEAF_SIZE);
+        if(!new_leaf) return false;
+
+        if(!shim_pages.zeroed) memset(new_leaf, 0, SHIM_LEAF_SIZE);
+
+        __atomic_store_n(&shim_root[root], new_leaf, __ATOMIC_RELEASE);
+    }
+
+    return true;
+}
+
+static bool shim_map_set(void* ptr, size_t size, uint8_t owner){
+    uintptr_t start = (uintptr_t) ptr;
+    uintptr_t end   = start + size;
+
+    shim_spin_lock(&shim_map_lock);
+    bool reserved = shim_map_reserve(start, end);
+    shim_spin_unlock(&shim_map_lock);
+
+    if(!reserved) return false;
+
+    for(uintptr_t addr = start; addr < end; addr += SHIM_GRANULE){
+        size_t root, leaf;
+        if(shim_key(addr, &root, &leaf)) __atomic_store_n(&shim_root[root][leaf], owner, __ATOMIC_RELAXED);
+    }
+
+    return true;
+}
+
+static uint8_t shim_map_get(void* ptr){
+    // A 0 bytes block at the end of a granule has its data pointer at the start of the next one,
+    // so look for the byte before it, which is always in the block
+    size_t root, leaf;
+    if(!shim_key((uintptr_t) ptr - 1, &root, &leaf)) return 0;
+
+    uint8_t* leaf_ptr = __atomic_load_n(&shim_root[root], __ATOMIC_ACQUIRE);
+    return leaf_ptr ? __atomic_load_n(&leaf_ptr[leaf], __ATOMIC_RELAXED) : 0;
+}
+
+// Page provider of the arenas, ctx is the index of the arena plus one
+
+static void* shim_page_alloc(void* ctx, size_t size){
+    size = (size_t) shim_align_up(size, SHIM_GRANULE);
+
+    void* ptr = shim_pages_alloc(size);
+    if(!ptr) return NULL;
+
+    if(!shim_map_set(ptr, size, (uint8_t) (uintptr_t) ctx)){
+        shim_pages.release(shim_pages.ctx, ptr, size);
+        return NULL;
+    }
+
+    return ptr;
+}
+
+static void shim_page_release(void* ctx, void* ptr, size_t size){
+    (void) ctx;
+
+    // Same rounding as in shim_page_alloc
+    size = (size_t) shim_align_up(size, SHIM_GRANULE);
+
+    shim_map_set(ptr, size, 0);
+    shim_pages.release(shim_pages.ctx, ptr, size);
+}
+
+// Arenas
+
+typedef struct {
+    arena_t arena;
+    int     ready;  // Set once the arena can be used
+} shim_slot_t;
+
+static shim_slot_t    shim_slots[TINYALLOC_SHIM_ARENAS];
+static arena_config_t shim_config;
+static bool           shim_configured;
+static bool           shim_started;
+
+static void shim_default_config(arena_config_t* config){
+    memset(config, 0, sizeof(*config));
+
+#if TINYALLOC_PTHREAD
+    config->lock = ARENA_LOCK_MUTEX;
+#else
+    config->lock = ARENA_LOCK_SPIN;
+#endif
+    config->tcache_count = 16;
+    config->slab         = true;
+}
+
+static arena_t* shim_arena(size_t index){
+    shim_slot_t* slot = &shim_slots[index];
+    if(__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE)) return &slot->arena;
+
+    shim_spin_lock(&shim_setup_lock);
+
+    if(!slot->ready){
+        if(!shim_configured){
+            shim_default_config(&shim_config);
+            shim_configured = true;
+        }
+
+        shim_started = true;
+
+        void* region = shim_page_alloc((void*) (uintptr_t) (index + 1), TINYALLOC_SHIM_REGION_SIZE);
+
+        if(region){
+            arena_config_t config = shim_config;
+
+            config.grow                  = true;
+            config.grow_chunk_size       = (size_t) shim_align_up(config.grow_chunk_size ? config.grow_chunk_size : GROW_CHUNK_SIZE, SHIM_GRANULE);
+            config.page_provider.alloc   = shim_page_alloc;
+            config.page_provider.release = shim_page_release;
+            config.page_provider.ctx     = (void*) (uintptr_t) (index + 1);
+            config.page_provider.zeroed  = shim_pages.zeroed;
+            config.zeroed                = shim_pages.zeroed;
+            config.trim_zeroes           = shim_pages.zeroed;
+            config.linear                = false;
+            config.remote_free           = false;
+
+            slot->arena.start_addr = region;
+            slot->arena.arena_size = (size_t) shim_align_up(TINYALLOC_SHIM_REGION_SIZE, SHIM_GRANULE);
+            arena_init_ex(&slot->arena, &config);
+
+            __atomic_store_n(&slot->ready, 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    shim_spin_unlock(&shim_setup_lock);
+    return slot->ready ? &slot->arena : NULL;
+}
+
+// Fork
+//
+// A thread holding a lock of the shim while another one forks would leave it held forever
+// in the child. The handlers take the setup lock, the arena locks in index order, then the map
+// lock (the order the allocation paths nest them in) and release them in the parent. The child
+// only has the forking thread, its locks are reset.
+
+#if TINYALLOC_PTHREAD
+
+static void shim_fork_prepare(void){
+    shim_spin_lock(&shim_setup_lock);
+
+    for(size_t i = 0; i < TINYALLOC_SHIM_ARENAS; i++){
+        if(shim_slots[i].ready) arena_fork_prepare(&shim_slots[i].arena);
+    }
+
+    shim_spin_lock(&shim_map_lock);
+}
+
+static void shim_fork_parent(void){
+    shim_spin_unlock(&shim_map_lock);
+
+    for(size_t i = TINYALLOC_SHIM_ARENAS; i-- > 0;){
+        if(shim_slots[i].ready) arena_fork_parent(&shim_slots[i].arena);
+    }
+
+    shim_spin_unlock(&shim_setup_lock);
+}
+
+static void shim_fork_child(void){
+    shim_map_lock = 0;
+
+    for(size_t i = 0; i < TINYALLOC_SHIM_ARENAS; i++){
+        if(shim_slots[i].ready) arena_fork_child(&shim_slots[i].arena);
+    }
+
+    shim_setup_lock = 0;
+}
+
+// Registered when the library is loaded: pthread_atfork can allocate, which can't happen
+// with the setup lock held
+__attribute__((constructor)) static void shim_fork_register(void){
+    pthread_atfork(shim_fork_prepare, shim_fork_parent, shim_fork_child);
+}
+
+#endif
+
+static size_t shim_thread_index(void){
+#if TINYALLOC_PTHREAD
+    // Threads are given the arenas round robin on their first allocation
+    static __thread size_t thread_index;    // Index plus one, 0 before the first call
+    static size_t          next_index;
+
+    if(!thread_index) thread_index = __atomic_fetch_add(&next_index, 1, __ATOMIC_RELAXED) % TINYALLOC_SHIM_ARENAS + 1;
+    return thread_index - 1;
+#else
+    return 0;
+#endif
+}
+
+static void* shim_alloc(size_t alignment, size_t size, bool clear){
+    // Arena of the thread first, then the other ones
+    size_t first = shim_thread_index();
+
+    for(size_t i = 0; i < TINYALLOC_SHIM_ARENAS; i++){
+        arena_t* arena_ptr = shim_arena((first + i) % TINYALLOC_SHIM_ARENAS);
+        if(!arena_ptr) continue;
+
+        void* ptr;
+
+        if(clear){
+            ptr = a_aligned_calloc(arena_ptr, alignment, 1, size);
+        } else {
+            ptr = (alignment <= (size_t) ALIGN_SIZE) ? a_malloc(arena_ptr, size) : a_aligned_alloc(arena_ptr, alignment, size);
+        }
+
+        if(ptr) return ptr;
+    }
+
+    return NULL;
+}
+
+// shim functions
+
+bool arena_shim_init(const arena_config_t* config){
+    shim_spin_lock(&shim_setup_lock);
+
+    bool done = !shim_started;
+
+    if(done){
+        if(config){
+            shim_config = *config;
+        } else {
+            shim_default_config(&shim_config);
+        }
+
+        if(shim_config.page_provider.alloc){
+            shim_pages = shim_config.page_provider;
+        }
+
+        shim_configured = true;
+    }
+
+    shim_spin_unlock(&shim_setup_lock);
+    return done;
+}
+
+arena_t* arena_shim_select(void){
+    return shim_arena(shim_thread_index());
+}
+
+arena_t* arena_shim_owner(void* ptr){
+    uint8_t owner = shim_map_get(ptr);
+    return owner ? &shim_slots[owner - 1].arena : NULL;
+}
+
+void* a_shim_malloc(size_t size){
+    return shim_alloc(TINYALLOC_SHIM_ALIGN, size, false);
+}
+
+void* a_shim_calloc(size_t count, size_t size){
+    if(size && count > SIZE_MAX / size) return NULL;
+
+    return shim_alloc(TINYALLOC_SHIM_ALIGN, count * size, true);
+}
+
+void* a_shim_aligned_alloc(size_t alignment, size_t size){
+    // Only powers of two are valid alignments
+    if(!alignment || (alignment & (alignment - 1))) return NULL;
+
+    return shim_alloc(alignment < TINYALLOC_SHIM_ALIGN ? TINYALLOC_SHIM_ALIGN : alignment, size, false);
+}
+
+void* a_shim_realloc(void* ptr, size_t size){
+    if(!ptr) return a_shim_malloc(size);
+
+    arena_t* owner = arena_shim_owner(ptr);
+    if(!owner) return NULL;
+
+    void* new_ptr = a_realloc(owner, ptr, size);
+
+    // A moved block only has the alignment of the arena
+    if(new_ptr && !((uintptr_t) new_ptr & (TINYALLOC_SHIM_ALIGN - 1))) return new_ptr;
+
+    void* old_ptr     = new_ptr ? new_ptr : ptr;
+    void* aligned_ptr = a_shim_malloc(size);
+
+    if(!aligned_ptr){
+        // ptr is gone if the block was moved, keeping the data matters more than the alignment
+        return new_ptr;
+    }
+
+    size_t actual_size = a_usable_size(owner, old_ptr);
+
+    memcpy(aligned_ptr, old_ptr, actual_size < size ? actual_size : size);
+    a_free(owner, old_ptr);
+
+    return aligned_ptr;
+}
+
+size_t a_shim_usable_size(void* ptr){
+    if(!ptr) return 0;
+
+    arena_t* owner = arena_shim_owner(ptr);
+    return owner ? a_usable_size(owner, ptr) : 0;
+}
+
+void a_shim_free(void* ptr){
+    if(!ptr) return;
+
+    arena_t* owner = arena_shim_owner(ptr);
+    if(owner) a_free(owner, ptr);
+}
+
+// C library functions
+
+#if TINYALLOC_SHIM_OVERRIDE
+
+void* malloc(size_t size){
+    void* ptr = a_shim_malloc(size);
+    if(!ptr) errno = ENOMEM;
+    return ptr;
+}
+
+void* calloc(size_t count, size_t size){
+    void* ptr = a_shim_calloc(count, size);
+    if(!ptr) errno = ENOMEM;
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size){
+    void* new_ptr = a_shim_realloc(ptr, size);
+    if(!new_ptr) errno = ENOMEM;
+    return new_ptr;
+}
+
+void free(void* ptr){
+    a_shim_free(ptr);
+}
+
+void* aligned_alloc(size_t alignment, size_t size){
+    void* ptr = a_shim_aligned_alloc(alignment, size);
+    if(!ptr) errno = (alignment && !(alignment & (alignment - 1))) ? ENOMEM : EINVAL;
+    return ptr;
+}
+
+int posix_memalign(void** out, size_t alignment, size_t size){
+    if(!alignment || (alignment & (alignment - 1)) || alignment % sizeof(void*)) return EINVAL;
+
+    void* ptr = a_shim_aligned_alloc(alignment, size);
+    if(!ptr) return ENOMEM;
+
+    *out = ptr;
+    return 0;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+
+void* valloc(size_t size){
+    void* ptr = a_shim_aligned_alloc((size_t) sysconf(_SC_PAGESIZE), size);
+    if(!ptr) errno = ENOMEM;
+    return ptr;
+}
+
+#endif
+
+#if defined(__linux__)
+
+// GNU extensions, they must go through the shim too since their pointers are given to free
+
+void* memalign(size_t alignment, size_t size){
+    void* ptr = a_shim_aligned_alloc(alignment, size);
+    if(!ptr) errno = ENOMEM;
+    return ptr;
+}
+
+void* pvalloc(size_t size){
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+    void* ptr = (size + page - 1 >= size) ? a_shim_aligned_alloc(page, (size + page - 1) & ~(page - 1)) : NULL;
+    if(!ptr) errno = ENOMEM;
+    return ptr;
+}
+
+void* reallocarray(void* ptr, size_t count, size_t size){
+    if(size && count > SIZE_MAX / size){
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return realloc(ptr, count * size);
+}
+
+size_t malloc_usable_size(void* ptr){
+    return a_shim_usable_size(ptr);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,140 @@
+/**
+ * @file tinyalloc_shim.h
+ * @author Brais Solla González
+ * @brief Global malloc / free replacement on top of a set of tinyalloc arenas
+ * @version 0.3
+ * @date 2021-09-07
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+
+#ifndef _TINYALLOC_SHIM_INCLUDED
+#define _TINYALLOC_SHIM_INCLUDED
+
+#include "tinyalloc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Arenas owned by the shim, threads are spread over them (at most 255)
+#ifndef TINYALLOC_SHIM_ARENAS
+#define TINYALLOC_SHIM_ARENAS 8
+#endif
+
+// Memory is taken from the page provider in granules of 2^TINYALLOC_SHIM_GRANULE_LOG2 bytes,
+// aligned to their size. Every granule belongs to a single arena
+#ifndef TINYALLOC_SHIM_GRANULE_LOG2
+#define TINYALLOC_SHIM_GRANULE_LOG2 16
+#endif
+
+// First region of every arena, chunks are added when it is full
+#ifndef TINYALLOC_SHIM_REGION_SIZE
+#define TINYALLOC_SHIM_REGION_SIZE (1024 * 1024)
+#endif
+
+// Alignment of every pointer returned, malloc must be suitable for any fundamental type.
+// Build tinyalloc.c and the shim with TINYALLOC_MIN_ALIGN at least this big (-DTINYALLOC_MIN_ALIGN=16)
+// so plain blocks are already aligned: malloc, calloc and realloc then keep the thread cache and the
+// slabs. Otherwise every call goes through a_aligned_alloc (always with boundary tags)
+#ifndef TINYALLOC_SHIM_ALIGN
+#define TINYALLOC_SHIM_ALIGN (2 * sizeof(void*))
+#endif
+
+// Define malloc, free, calloc, realloc and friends. 0 only provides the a_shim_* functions
+#ifndef TINYALLOC_SHIM_OVERRIDE
+#define TINYALLOC_SHIM_OVERRIDE 1
+#endif
+
+// shim functions
+
+/**
+ * @brief Sets the configuration of the shim arenas, before the first allocation
+ *
+ * @param config Configuration used by every arena, or NULL to use the defaults (ARENA_LOCK_MUTEX with pthread,
+ *               ARENA_LOCK_SPIN otherwise, thread cache and slabs). grow is always set, linear and remote_free
+ *               are ignored. A page_provider must return memory aligned to the granule, mmap is used otherwise
+ * @return true on success, false if an arena is already in use
+ *
+ * Calling it is optional, the arenas are set up with the defaults on the first allocation
+ */
+bool arena_shim_init(const arena_config_t* config);
+
+/**
+ * @brief Returns the arena used by the calling thread
+ *
+ * @return arena_t* Arena picked for the thread on its first call, or NULL if its first region couldn't be mapped
+ */
+arena_t* arena_shim_select(void);
+
+/**
+ * @brief Returns the arena owning a pointer
+ *
+ * @param ptr Any pointer
+ * @return arena_t* Arena whose memory contains ptr, or NULL if the memory doesn't come from the shim
+ *
+ * The lookup goes through the radix table of the granules, without locking and without walking the chunks
+ */
+arena_t* arena_shim_owner(void* ptr);
+
+/**
+ * @brief Allocates memory in the arena of the calling thread
+ *
+ * @param size Size of the memory to allocate in bytes
+ * @return void* Pointer to memory aligned to TINYALLOC_SHIM_ALIGN or NULL on error
+ *
+ * If the arena of the thread is full, the other arenas are tried in order
+ */
+void* a_shim_malloc(size_t size);
+
+/**
+ * @brief Allocates zeroed memory for count elements of size bytes
+ *
+ * @param count Number of elements
+ * @param size Size of an element in bytes
+ * @return void* Pointer to memory allocated or NULL on error (Example: count * size overflows)
+ */
+void* a_shim_calloc(size_t count, size_t size);
+
+/**
+ * @brief Allocates memory aligned to alignment bytes in the arena of the calling thread
+ *
+ * @param alignment Alignment of the returned pointer in bytes, must be a power of two
+ * @param size Size of the memory to allocate in bytes
+ * @return void* Pointer to memory allocated or NULL on error
+ */
+void* a_shim_aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * @brief Reallocates memory in the arena owning ptr
+ *
+ * @param ptr Pointer previously returned by the shim or NULL to perform an a_shim_malloc operation
+ * @param size New size in bytes
+ * @return void* New pointer to the block, or NULL on error (Example: ptr doesn't come from the shim)
+ *
+ * If the owner arena can't hold the new size, the block is moved to another arena
+ */
+void* a_shim_realloc(void* ptr, size_t size);
+
+/**
+ * @brief Returns the usable size of a block
+ *
+ * @param ptr Pointer previously returned by the shim, or NULL
+ * @return size_t Bytes usable at ptr, 0 for NULL or memory that doesn't come from the shim
+ */
+size_t a_shim_usable_size(void* ptr);
+
+/**
+ * @brief Frees memory in the arena owning ptr
+ *
+ * @param ptr Pointer previously returned by the shim, from any thread. Other pointers are ignored
+ */
+void  a_shim_free(void* ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif